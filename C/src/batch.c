@@ -0,0 +1,299 @@
+#include "batch.h"
+#include "source.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// What a worker sends back for each script, followed by length bytes of
+// the script's output.
+typedef struct {
+    int index;
+    int status;
+    double seconds;
+    size_t length;
+} Report;
+
+typedef struct {
+    Report report;
+    char* output;
+    bool done;
+} Result;
+
+typedef struct {
+    pid_t pid;
+    // Reports arrive here; -1 once the worker has closed its end.
+    int reports;
+} Worker;
+
+static double wallClock()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static bool writeAll(int fd, const void* bytes, size_t length)
+{
+    const char* next = (const char*)bytes;
+    while (length > 0)
+    {
+        ssize_t written = write(fd, next, length);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        next += written;
+        length -= (size_t)written;
+    }
+    return true;
+}
+
+// Returns false on an error, or when the other end closes before length
+// bytes arrive.
+static bool readAll(int fd, void* bytes, size_t length)
+{
+    char* next = (char*)bytes;
+    while (length > 0)
+    {
+        ssize_t got = read(fd, next, length);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        next += got;
+        length -= (size_t)got;
+    }
+    return true;
+}
+
+// The script process. It starts from the worker's copy of the warmed VM
+// and throws it away with its globals when it exits.
+static void runScript(VM* machine, const char* path, bool useCache, int output)
+{
+    dup2(output, STDOUT_FILENO);
+    dup2(output, STDERR_FILENO);
+    close(output);
+    // Keeps printed lines and error messages in the order they happened.
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    Source source;
+    if (!readSource(path, &source)) exit(74);
+    InterpretResult result = interpretFile(machine, path, &source, useCache);
+
+    if (result == INTERPRET_COMPILE_ERROR) exit(65);
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    exit(0);
+}
+
+// Collects the whole output before waiting, so a script never blocks on a
+// full pipe. Returns NULL with *status set when no process could start.
+static char* runInChild(VM* machine, const char* path, bool useCache, int* status, size_t* length)
+{
+    *length = 0;
+    *status = 71;
+
+    int fds[2];
+    if (pipe(fds) != 0) return NULL;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(fds[0]);
+        runScript(machine, path, useCache, fds[1]);
+    }
+    close(fds[1]);
+    if (pid < 0)
+    {
+        close(fds[0]);
+        return NULL;
+    }
+
+    size_t capacity = 4096;
+    char* output = (char*)malloc(capacity);
+    if (output == NULL) exit(1);
+    for (;;)
+    {
+        if (*length == capacity)
+        {
+            capacity *= 2;
+            output = (char*)realloc(output, capacity);
+            if (output == NULL) exit(1);
+        }
+        ssize_t got = read(fds[0], output + *length, capacity - *length);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        *length += (size_t)got;
+    }
+    close(fds[0]);
+
+    int wait;
+    while (waitpid(pid, &wait, 0) < 0)
+    {
+        if (errno != EINTR) return output;
+    }
+    // Like the shell, a script killed by a signal reports 128 + its number.
+    *status = WIFEXITED(wait) ? WEXITSTATUS(wait) : 128 + WTERMSIG(wait);
+    return output;
+}
+
+static void runWorker(VM* machine, const char** paths, int count, bool useCache, atomic_int* next, int reports)
+{
+    for (int index; (index = atomic_fetch_add(next, 1)) < count;)
+    {
+        Report report;
+        report.index = index;
+
+        double begin = wallClock();
+        char* output = runInChild(machine, paths[index], useCache, &report.status, &report.length);
+        report.seconds = wallClock() - begin;
+
+        bool sent = writeAll(reports, &report, sizeof(Report)) && writeAll(reports, output, report.length);
+        free(output);
+        if (!sent) break;
+    }
+    close(reports);
+}
+
+// Returns false once the worker is done.
+static bool readReport(Worker* worker, Result* results, int count)
+{
+    Report report;
+    if (!readAll(worker->reports, &report, sizeof(Report))) return false;
+    if (report.index < 0 || report.index >= count) return false;
+
+    Result* result = &results[report.index];
+    result->output = (char*)malloc(report.length + 1);
+    if (result->output == NULL) exit(1);
+    if (!readAll(worker->reports, result->output, report.length)) return false;
+
+    result->report = report;
+    result->done = true;
+    return true;
+}
+
+static void printResult(const char* path, Result* result)
+{
+    if (!result->done)
+    {
+        printf("== %s: no result, its worker died\n", path);
+        return;
+    }
+    printf("== %s: exit %d, %f seconds\n", path, result->report.status, result->report.seconds);
+    fwrite(result->output, 1, result->report.length, stdout);
+    if (result->report.length > 0 && result->output[result->report.length - 1] != '\n') printf("\n");
+}
+
+static int workerCount(int count)
+{
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers > count) workers = count;
+    return workers < 1 ? 1 : (int)workers;
+}
+
+int runBatch(VM* machine, const char** paths, int count, bool useCache)
+{
+    if (count == 0) return 0;
+
+    Result* results = (Result*)calloc(count, sizeof(Result));
+    int workers = workerCount(count);
+    Worker* pool = (Worker*)malloc(sizeof(Worker) * workers);
+    // The queue is just the index of the next script, shared by the workers.
+    atomic_int* next = (atomic_int*)mmap(NULL, sizeof(atomic_int), PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == NULL || pool == NULL || next == MAP_FAILED) exit(1);
+    atomic_init(next, 0);
+
+    // Anything still buffered would be written again by every child.
+    fflush(stdout);
+    fflush(stderr);
+
+    double begin = wallClock();
+    int running = 0;
+    for (int i = 0; i < workers; ++i)
+    {
+        int fds[2];
+        if (pipe(fds) != 0) break;
+
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(fds[0]);
+            for (int j = 0; j < running; ++j) close(pool[j].reports);
+            runWorker(machine, paths, count, useCache, next, fds[1]);
+            _exit(0);
+        }
+        close(fds[1]);
+        if (pid < 0)
+        {
+            close(fds[0]);
+            break;
+        }
+        pool[running].pid = pid;
+        pool[running].reports = fds[0];
+        running++;
+    }
+    if (running == 0)
+    {
+        fprintf(stderr, "Could not start a batch worker.\n");
+        exit(71);
+    }
+
+    struct pollfd* polls = (struct pollfd*)malloc(sizeof(struct pollfd) * running);
+    if (polls == NULL) exit(1);
+
+    // Results are printed in the order the scripts were given, as soon as
+    // every one before them is in.
+    int printed = 0;
+    for (int open = running; open > 0;)
+    {
+        for (int i = 0; i < running; ++i)
+        {
+            polls[i].fd = pool[i].reports;
+            polls[i].events = POLLIN;
+        }
+        if (poll(polls, running, -1) < 0)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (int i = 0; i < running; ++i)
+        {
+            if (pool[i].reports < 0 || polls[i].revents == 0) continue;
+            if (!readReport(&pool[i], results, count))
+            {
+                close(pool[i].reports);
+                pool[i].reports = -1;
+                open--;
+            }
+        }
+
+        for (; printed < count && results[printed].done; ++printed) printResult(paths[printed], &results[printed]);
+    }
+
+    for (int i = 0; i < running; ++i)
+    {
+        if (pool[i].reports >= 0) close(pool[i].reports);
+        while (waitpid(pool[i].pid, NULL, 0) < 0 && errno == EINTR);
+    }
+    double seconds = wallClock() - begin;
+
+    int failed = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        if (i >= printed) printResult(paths[i], &results[i]);
+        if (!results[i].done || results[i].report.status != 0) failed++;
+        free(results[i].output);
+    }
+    printf("Batch: %d scripts, %d failed, %f seconds on %d workers\n", count, failed, seconds, running);
+
+    free(polls);
+    free(pool);
+    free(results);
+    munmap(next, sizeof(atomic_int));
+    return failed;
+}
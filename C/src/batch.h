@@ -0,0 +1,14 @@
+#ifndef clox_batch_h
+#define clox_batch_h
+
+#include "common.h"
+#include "vm.h"
+
+// Runs each of the scripts at paths in a process forked from this one, so
+// machine and everything set up so far is shared copy-on-write instead of
+// built again per script. One worker per core takes the scripts in turn.
+// Prints every script's output, exit status and time in the order given,
+// followed by a summary, and returns the number of scripts that failed.
+int runBatch(VM* machine, const char** paths, int count, bool useCache);
+
+#endif
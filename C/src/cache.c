@@ -0,0 +1,666 @@
+#include "cache.h"
+#include "chunk.h"
+#include "memory.h"
+#include "vm.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// File layout, all integers little-endian:
+//
+//   "LOXC" u32 version, u64 build hash, u64 source hash, u64 source length,
+//   u64 hash of the rest of the file
+//   u32 global count, then each global name as u32 length + bytes
+//   the script function
+//
+// and each function is:
+//
+//   u32 arity, name (u32 length + bytes, or 0xffffffff for the script)
+//   u32 code count + code bytes
+//   u32 encoded line count + bytes, u32 checkpoint count + 3 u32 each
+//   u32 constant count, then tagged constants, nested functions inline
+//
+// A function referenced from more than one chunk, such as one inlined
+// into other functions' calls, is written out the first time only. After
+// that it is a u32 index into the functions written so far, counted in the
+// order they are completed.
+#define CACHE_MAGIC "LOXC"
+#define CACHE_HEADER_SIZE 40
+#define CACHE_VERSION 2
+#define CACHE_MAX_DEPTH 256
+#define NO_NAME 0xffffffffu
+
+typedef enum {
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION,
+    CONSTANT_FUNCTION_INDEX,
+} ConstantTag;
+
+// Functions written or read so far, in the order they were completed.
+typedef struct {
+    ObjFunction** functions;
+    int count;
+    int capacity;
+} FunctionList;
+
+static bool appendFunction(FunctionList* list, ObjFunction* function)
+{
+    if (list->capacity < list->count + 1)
+    {
+        int capacity = list->capacity < 8 ? 8 : list->capacity * 2;
+        ObjFunction** grown = (ObjFunction**)realloc(list->functions, sizeof(ObjFunction*) * capacity);
+        if (grown == NULL) return false;
+        list->functions = grown;
+        list->capacity = capacity;
+    }
+    list->functions[list->count++] = function;
+    return true;
+}
+
+static uint64_t hashBytes(uint64_t hash, const void* bytes, size_t length)
+{
+    const uint8_t* data = (const uint8_t*)bytes;
+    for (size_t i = 0; i < length; ++i)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+#define CACHE_HASH_SEED 0xcbf29ce484222325ull
+
+// Changes whenever opcodes are added, removed, reordered or resized.
+static uint64_t buildHash()
+{
+    static const char opcodes[] =
+#define OPCODE_STRING(name, operands) #name ":" #operands " "
+        OPCODE_LIST(OPCODE_STRING)
+#undef OPCODE_STRING
+        ;
+    uint32_t version = CACHE_VERSION;
+    uint64_t hash = hashBytes(CACHE_HASH_SEED, &version, sizeof(version));
+    return hashBytes(hash, opcodes, sizeof(opcodes));
+}
+
+static char* cachePath(const char* path)
+{
+    size_t length = strlen(path);
+    char* result = (char*)malloc(length + sizeof(".loxc"));
+    if (result == NULL) return NULL;
+
+    memcpy(result, path, length);
+    memcpy(result + length, ".loxc", sizeof(".loxc"));
+    return result;
+}
+
+// Writing
+
+// The payload is built in memory so that its hash can go in the header.
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+    bool failed;
+    FunctionList written;
+} Writer;
+
+static void writeBytes(Writer* writer, const void* bytes, size_t length)
+{
+    if (writer->failed) return;
+
+    if (writer->capacity - writer->count < length)
+    {
+        size_t capacity = writer->capacity < 256 ? 256 : writer->capacity;
+        while (capacity - writer->count < length) capacity *= 2;
+
+        uint8_t* grown = (uint8_t*)realloc(writer->bytes, capacity);
+        if (grown == NULL)
+        {
+            writer->failed = true;
+            return;
+        }
+        writer->bytes = grown;
+        writer->capacity = capacity;
+    }
+
+    if (length > 0) memcpy(writer->bytes + writer->count, bytes, length);
+    writer->count += length;
+}
+
+static void writeU8(Writer* writer, uint8_t value)
+{
+    writeBytes(writer, &value, 1);
+}
+
+static void writeU32(Writer* writer, uint32_t value)
+{
+    uint8_t bytes[4];
+    for (int i = 0; i < 4; ++i) bytes[i] = (uint8_t)(value >> (8 * i));
+    writeBytes(writer, bytes, sizeof(bytes));
+}
+
+static void writeU64(Writer* writer, uint64_t value)
+{
+    writeU32(writer, (uint32_t)value);
+    writeU32(writer, (uint32_t)(value >> 32));
+}
+
+static void writeString(Writer* writer, ObjString* string)
+{
+    writeU32(writer, (uint32_t)string->length);
+    writeBytes(writer, string->chars, string->length);
+}
+
+// Functions are few enough per script for a linear search.
+static int writtenIndex(Writer* writer, ObjFunction* function)
+{
+    for (int i = 0; i < writer->written.count; ++i)
+    {
+        if (writer->written.functions[i] == function) return i;
+    }
+    return -1;
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+
+    writeU32(writer, (uint32_t)function->arity);
+    if (function->name == NULL) writeU32(writer, NO_NAME);
+    else writeString(writer, function->name);
+
+    writeU32(writer, (uint32_t)chunk->count);
+    writeBytes(writer, chunk->code, chunk->count);
+
+    LineArray* lines = &chunk->lines;
+    writeU32(writer, (uint32_t)lines->encodedCount);
+    writeBytes(writer, lines->encoded, lines->encodedCount);
+    writeU32(writer, (uint32_t)lines->checkpointCount);
+    for (int i = 0; i < lines->checkpointCount; ++i)
+    {
+        writeU32(writer, (uint32_t)lines->checkpoints[i].startByteOffset);
+        writeU32(writer, (uint32_t)lines->checkpoints[i].line);
+        writeU32(writer, (uint32_t)lines->checkpoints[i].position);
+    }
+
+    writeU32(writer, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; ++i)
+    {
+        Value constant = chunk->constants.values[i];
+        if (IS_NUMBER(constant))
+        {
+            double number = AS_NUMBER(constant);
+            uint64_t bits;
+            memcpy(&bits, &number, sizeof(bits));
+            writeU8(writer, CONSTANT_NUMBER);
+            writeU64(writer, bits);
+        }
+        else if (IS_SMALL_STRING(constant))
+        {
+            char chars[SMALL_STRING_MAX];
+            int length = smallStringChars(constant, chars);
+            writeU8(writer, CONSTANT_STRING);
+            writeU32(writer, (uint32_t)length);
+            writeBytes(writer, chars, length);
+        }
+        else if (IS_STRING(constant))
+        {
+            writeU8(writer, CONSTANT_STRING);
+            writeString(writer, AS_STRING(constant));
+        }
+        else if (writtenIndex(writer, AS_FUNCTION(constant)) != -1)
+        {
+            writeU8(writer, CONSTANT_FUNCTION_INDEX);
+            writeU32(writer, (uint32_t)writtenIndex(writer, AS_FUNCTION(constant)));
+        }
+        else
+        {
+            writeU8(writer, CONSTANT_FUNCTION);
+            writeFunction(writer, AS_FUNCTION(constant));
+        }
+    }
+
+    if (!appendFunction(&writer->written, function)) writer->failed = true;
+}
+
+bool encodeScript(ObjFunction* function, const char* source, size_t length, CachedScript* script)
+{
+    Writer payload = { NULL, 0, 0, false, { NULL, 0, 0 } };
+    ValueArray* names = &vm->modules[vm->module]->names;
+    writeU32(&payload, (uint32_t)names->count);
+    for (int i = 0; i < names->count; ++i)
+    {
+        writeString(&payload, AS_STRING(names->values[i]));
+    }
+    writeFunction(&payload, function);
+    free(payload.written.functions);
+
+    Writer file = { NULL, 0, 0, payload.failed, { NULL, 0, 0 } };
+    writeBytes(&file, CACHE_MAGIC, 4);
+    writeU32(&file, CACHE_VERSION);
+    writeU64(&file, buildHash());
+    writeU64(&file, hashBytes(CACHE_HASH_SEED, source, length));
+    writeU64(&file, (uint64_t)length);
+    writeU64(&file, hashBytes(CACHE_HASH_SEED, payload.bytes, payload.count));
+    writeBytes(&file, payload.bytes, payload.count);
+    free(payload.bytes);
+
+    if (file.failed)
+    {
+        free(file.bytes);
+        return false;
+    }
+    script->bytes = file.bytes;
+    script->count = file.count;
+    script->mappedSize = 0;
+    return true;
+}
+
+void writeCachedScript(const char* path, CachedScript* script)
+{
+    // Written under a temporary name and renamed into place, so a reader
+    // never sees a partial file.
+    char* target = cachePath(path);
+    char* temporary = target == NULL ? NULL : (char*)malloc(strlen(target) + sizeof(".tmp"));
+    if (temporary != NULL)
+    {
+        strcpy(temporary, target);
+        strcat(temporary, ".tmp");
+
+        FILE* file = fopen(temporary, "wb");
+        if (file != NULL)
+        {
+            fwrite(script->bytes, 1, script->count, file);
+
+            bool failed = ferror(file);
+            if (fclose(file) != 0) failed = true;
+
+            if (failed || rename(temporary, target) != 0) remove(temporary);
+        }
+    }
+
+    free(temporary);
+    free(target);
+}
+
+void freeCachedScript(CachedScript* script)
+{
+    if (script->mappedSize > 0)
+    {
+        munmap(script->bytes, script->mappedSize);
+    }
+    else
+    {
+        free(script->bytes);
+    }
+}
+
+// Reading. Every read is bounds checked; any inconsistency makes the
+// whole file a cache miss.
+
+typedef struct {
+    const uint8_t* current;
+    const uint8_t* end;
+    bool valid;
+
+    // Global slots of this VM, indexed by the slot recorded in the file.
+    int* globalMap;
+    int globalCount;
+    int depth;
+    FunctionList read;
+} Reader;
+
+static bool has(Reader* reader, size_t length)
+{
+    if (!reader->valid || (size_t)(reader->end - reader->current) < length)
+    {
+        reader->valid = false;
+        return false;
+    }
+    return true;
+}
+
+static uint32_t readU32(Reader* reader)
+{
+    if (!has(reader, 4)) return 0;
+
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) value |= (uint32_t)reader->current[i] << (8 * i);
+    reader->current += 4;
+    return value;
+}
+
+static uint64_t readU64(Reader* reader)
+{
+    uint64_t low = readU32(reader);
+    uint64_t high = readU32(reader);
+    return low | high << 32;
+}
+
+static const uint8_t* readBytes(Reader* reader, uint32_t length)
+{
+    if (!has(reader, length)) return NULL;
+
+    const uint8_t* bytes = reader->current;
+    reader->current += length;
+    return bytes;
+}
+
+static ObjString* readString(Reader* reader, uint32_t length)
+{
+    if (length > INT32_MAX) reader->valid = false;
+    const uint8_t* chars = readBytes(reader, length);
+    if (chars == NULL) return NULL;
+    return copyString((const char*)chars, (int)length);
+}
+
+static bool readVarint(LineArray* lines, int* position, uint32_t* value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 35; shift += 7)
+    {
+        if (*position >= lines->encodedCount) return false;
+        uint8_t byte = lines->encoded[(*position)++];
+        *value |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// getLine() trusts the encoded stream, so walk it once here and check
+// that every checkpoint matches the state it claims to resume from.
+static bool validateLines(LineArray* lines)
+{
+    int position = 0;
+    int start = 0;
+    int line = 0;
+    int checkpoint = 0;
+
+    while (position < lines->encodedCount)
+    {
+        while (checkpoint < lines->checkpointCount && lines->checkpoints[checkpoint].position == position)
+        {
+            LineCheckpoint* expected = &lines->checkpoints[checkpoint++];
+            if (expected->startByteOffset != start || expected->line != line) return false;
+        }
+
+        uint32_t length;
+        uint32_t zigzag;
+        if (!readVarint(lines, &position, &length) || !readVarint(lines, &position, &zigzag)) return false;
+        line += (int)(zigzag >> 1) ^ -(int)(zigzag & 1);
+        start += (int)length;
+    }
+    return checkpoint == lines->checkpointCount;
+}
+
+static bool validConstant(Chunk* chunk, int constant)
+{
+    return constant < chunk->constants.count;
+}
+
+// Checks operands against the chunk and rewrites global slots for this VM.
+static bool linkCode(Reader* reader, Chunk* chunk)
+{
+    uint8_t last = OP_COUNT;
+    for (int offset = 0; offset < chunk->count;)
+    {
+        uint8_t* code = &chunk->code[offset];
+        last = code[0];
+        if (code[0] >= OP_COUNT) return false;
+
+        int length = instructionLength(code[0]);
+        if (offset + length > chunk->count) return false;
+
+        switch (code[0])
+        {
+            case OP_CONSTANT:
+                if (!validConstant(chunk, code[1])) return false;
+                break;
+            case OP_CONSTANT_LONG:
+                if (!validConstant(chunk, readLongOperand(&code[1]))) return false;
+                break;
+            case OP_ADD_LOCAL_CONSTANT:
+            case OP_LESS_LOCAL_CONSTANT:
+            case OP_LESS_LOCAL_CONSTANT_JUMP:
+            case OP_LESS_LOCAL_CONSTANT_JUMP_OR_POP:
+            case OP_INCREMENT_LOCAL:
+            case OP_INLINE_CALL:
+                if (!validConstant(chunk, code[2])) return false;
+                break;
+            case OP_DEFINE_GLOBAL:
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL: {
+                if (code[1] >= reader->globalCount) return false;
+                int slot = reader->globalMap[code[1]];
+                if (slot > UINT8_MAX) return false;
+                code[1] = (uint8_t)slot;
+                break;
+            }
+            case OP_DEFINE_GLOBAL_LONG:
+            case OP_GET_GLOBAL_LONG:
+            case OP_SET_GLOBAL_LONG: {
+                int index = readLongOperand(&code[1]);
+                if (index >= reader->globalCount) return false;
+                int slot = reader->globalMap[index];
+                code[1] = (slot >> 16) & 0xff;
+                code[2] = (slot >> 8) & 0xff;
+                code[3] = slot & 0xff;
+                break;
+            }
+            default:
+                break;
+        }
+
+        // jumpTarget() returns -1 for non-jumps, which only a loop can reach.
+        int target = jumpTarget(chunk, offset);
+        if (target < -1 || target >= chunk->count || (target == -1 && code[0] == OP_LOOP)) return false;
+
+        offset += length;
+    }
+
+    // Execution must not be able to run off the end of the code.
+    return last == OP_RETURN || last == OP_JUMP || last == OP_LOOP;
+}
+
+static ObjFunction* readFunction(Reader* reader)
+{
+    if (++reader->depth > CACHE_MAX_DEPTH) reader->valid = false;
+
+    ObjFunction* function = newFunction();
+    push(OBJ_VAL(function));
+    Chunk* chunk = &function->chunk;
+
+    function->arity = (int)readU32(reader);
+    if (function->arity > UINT8_MAX) reader->valid = false;
+
+    uint32_t nameLength = readU32(reader);
+    if (nameLength != NO_NAME) function->name = readString(reader, nameLength);
+
+    uint32_t count = readU32(reader);
+    const uint8_t* code = readBytes(reader, count);
+    if (code != NULL && count > 0)
+    {
+        chunk->code = ALLOCATE(uint8_t, count);
+        chunk->capacity = (int)count;
+        chunk->count = (int)count;
+        memcpy(chunk->code, code, count);
+    }
+
+    LineArray* lines = &chunk->lines;
+    uint32_t encodedCount = readU32(reader);
+    const uint8_t* encoded = readBytes(reader, encodedCount);
+    uint32_t checkpointCount = readU32(reader);
+    if (encoded != NULL && has(reader, (size_t)checkpointCount * 12) && encodedCount > 0)
+    {
+        lines->encoded = ALLOCATE(uint8_t, encodedCount);
+        lines->encodedCount = (int)encodedCount;
+        memcpy(lines->encoded, encoded, encodedCount);
+
+        lines->checkpoints = ALLOCATE(LineCheckpoint, checkpointCount);
+        lines->checkpointCount = (int)checkpointCount;
+        for (uint32_t i = 0; i < checkpointCount; ++i)
+        {
+            lines->checkpoints[i].startByteOffset = (int)readU32(reader);
+            lines->checkpoints[i].line = (int)readU32(reader);
+            lines->checkpoints[i].position = (int)readU32(reader);
+        }
+        if (!validateLines(lines)) reader->valid = false;
+    }
+    else if (encodedCount > 0 || checkpointCount > 0)
+    {
+        reader->valid = false;
+    }
+
+    uint32_t constantCount = readU32(reader);
+    for (uint32_t i = 0; i < constantCount && reader->valid; ++i)
+    {
+        const uint8_t* tag = readBytes(reader, 1);
+        if (tag == NULL) break;
+
+        Value constant;
+        switch (*tag)
+        {
+            case CONSTANT_NUMBER: {
+                uint64_t bits = readU64(reader);
+                double number;
+                memcpy(&number, &bits, sizeof(number));
+                constant = NUMBER_VAL(number);
+                break;
+            }
+            case CONSTANT_STRING: {
+                uint32_t length = readU32(reader);
+                if (length > INT32_MAX) reader->valid = false;
+                const uint8_t* chars = readBytes(reader, length);
+                if (chars == NULL) continue;
+                constant = copyStringValue((const char*)chars, (int)length);
+                break;
+            }
+            case CONSTANT_FUNCTION: {
+                ObjFunction* nested = readFunction(reader);
+                if (nested == NULL) continue;
+                constant = OBJ_VAL(nested);
+                break;
+            }
+            case CONSTANT_FUNCTION_INDEX: {
+                // Only completed functions are listed, so this cannot
+                // make a cycle.
+                uint32_t index = readU32(reader);
+                if (index >= (uint32_t)reader->read.count) reader->valid = false;
+                if (!reader->valid) continue;
+                constant = OBJ_VAL(reader->read.functions[index]);
+                break;
+            }
+            default:
+                reader->valid = false;
+                continue;
+        }
+
+        // The compiler never stores duplicates, so indexes are preserved.
+        push(constant);
+        if (addConstant(chunk, constant) != (int)i) reader->valid = false;
+        pop();
+    }
+
+    if (reader->valid && !linkCode(reader, chunk)) reader->valid = false;
+    if (reader->valid && !appendFunction(&reader->read, function)) reader->valid = false;
+
+    pop();
+    reader->depth--;
+    return reader->valid ? function : NULL;
+}
+
+static bool readHeader(Reader* reader, const char* source, size_t length)
+{
+    const uint8_t* magic = readBytes(reader, 4);
+    if (magic == NULL || memcmp(magic, CACHE_MAGIC, 4) != 0) return false;
+    if (readU32(reader) != CACHE_VERSION) return false;
+    if (readU64(reader) != buildHash()) return false;
+    if (readU64(reader) != hashBytes(CACHE_HASH_SEED, source, length)) return false;
+    if (readU64(reader) != (uint64_t)length) return false;
+
+    uint64_t payloadHash = readU64(reader);
+    return reader->valid &&
+        payloadHash == hashBytes(CACHE_HASH_SEED, reader->current, (size_t)(reader->end - reader->current));
+}
+
+bool readCachedScript(const char* path, const char* source, size_t length, CachedScript* script)
+{
+    char* cached = cachePath(path);
+    if (cached == NULL) return false;
+
+    int fd = open(cached, O_RDONLY);
+    free(cached);
+    if (fd < 0) return false;
+
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)status.st_size;
+    void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return false;
+
+    Reader reader;
+    reader.current = (const uint8_t*)mapping;
+    reader.end = reader.current + size;
+    reader.valid = true;
+    if (!readHeader(&reader, source, length))
+    {
+        munmap(mapping, size);
+        return false;
+    }
+
+    script->bytes = (uint8_t*)mapping;
+    script->count = size;
+    script->mappedSize = size;
+    return true;
+}
+
+ObjFunction* decodeScript(CachedScript* script)
+{
+    Reader reader;
+    reader.current = script->bytes + CACHE_HEADER_SIZE;
+    reader.end = script->bytes + script->count;
+    reader.valid = true;
+    reader.globalMap = NULL;
+    reader.globalCount = 0;
+    reader.depth = 0;
+    reader.read.functions = NULL;
+    reader.read.count = 0;
+    reader.read.capacity = 0;
+
+    ObjFunction* function = NULL;
+    uint32_t globalCount = readU32(&reader);
+    // Each name takes at least its four-byte length.
+    if (has(&reader, (size_t)globalCount * 4))
+    {
+        reader.globalMap = (int*)malloc(sizeof(int) * (globalCount + 1));
+        reader.globalCount = (int)globalCount;
+        if (reader.globalMap == NULL) reader.valid = false;
+    }
+
+    for (uint32_t i = 0; i < globalCount && reader.valid; ++i)
+    {
+        ObjString* name = readString(&reader, readU32(&reader));
+        if (name != NULL) reader.globalMap[i] = globalSlot(name);
+    }
+
+    if (reader.valid) function = readFunction(&reader);
+    if (reader.current != reader.end) function = NULL;
+    if (function != NULL && (function->arity != 0 || function->name != NULL)) function = NULL;
+
+    free(reader.globalMap);
+    free(reader.read.functions);
+    return function;
+}
@@ -0,0 +1,33 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "object.h"
+
+#include <stddef.h>
+
+// Compiled scripts are cached next to their source as "<path>.loxc". The
+// cache is keyed by a hash of the source text and of this build's opcode
+// set, so a stale or foreign file is simply ignored.
+//
+// A CachedScript holds the bytes of such a file. Reading, checking and
+// writing them touches no VM, so any thread can do it; only encoding and
+// decoding run in a VM.
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    // Nonzero when bytes maps the cache file instead of coming from malloc().
+    size_t mappedSize;
+} CachedScript;
+
+// Maps the cache file of path, if it is valid for source.
+bool readCachedScript(const char* path, const char* source, size_t length, CachedScript* script);
+void writeCachedScript(const char* path, CachedScript* script);
+void freeCachedScript(CachedScript* script);
+
+// Serializes function, compiled from source in the current module.
+bool encodeScript(ObjFunction* function, const char* source, size_t length, CachedScript* script);
+// Rebuilds a script that readCachedScript() or encodeScript() produced, with
+// its globals resolved in the current module.
+ObjFunction* decodeScript(CachedScript* script);
+
+#endif
@@ -1,7 +1,11 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
+#include "vm.h"
+
+#define CONSTANT_INDEX_MAX_LOAD 0.75
 
 void initChunk(Chunk* chunk)
 {
@@ -9,6 +13,9 @@ void initChunk(Chunk* chunk)
     chunk->capacity = 0;
     chunk->code = NULL;
     initValueArray(&chunk->constants);
+    chunk->constantIndex.count = 0;
+    chunk->constantIndex.capacity = 0;
+    chunk->constantIndex.buckets = NULL;
     initLineArray(&chunk->lines);
 }
 
@@ -26,28 +33,137 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line)
    chunk->count++;
 }
 
+void truncateChunk(Chunk* chunk, int count)
+{
+    chunk->count = count;
+    truncateLineArray(&chunk->lines, count);
+}
+
 void freeChunk(Chunk* chunk)
 {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     freeLineArray(&chunk->lines);
     freeValueArray(&chunk->constants);
+    FREE_ARRAY(int, chunk->constantIndex.buckets, chunk->constantIndex.capacity);
     initChunk(chunk);
 }
 
+// Constants are shared only when they are indistinguishable: numbers by
+// their bits, so 0 and -0 stay apart, objects by identity, which covers
+// strings since they are interned, and small strings by their characters.
+static uint64_t constantBits(Value value)
+{
+#ifdef NAN_BOXING
+    return value;
+#else
+    uint64_t bits = 0;
+    if (IS_NUMBER(value)) memcpy(&bits, &value.as.number, sizeof(double));
+    else if (IS_OBJ(value)) bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+    else if (IS_SMALL_STRING(value)) bits = AS_SMALL_STRING(value);
+    else if (IS_BOOL(value)) bits = AS_BOOL(value);
+    return bits ^ ((uint64_t)value.type << 56);
+#endif
+}
+
+static bool sameConstant(Value a, Value b)
+{
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    // Eight characters fill all the bits, so the type is compared apart.
+    return a.type == b.type && constantBits(a) == constantBits(b);
+#endif
+}
+
+static uint32_t hashConstant(uint64_t bits)
+{
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+static int* findConstant(ConstantIndex* index, ValueArray* constants, Value value)
+{
+    uint32_t bucket = hashConstant(constantBits(value)) & (index->capacity - 1);
+    for (;;)
+    {
+        int* entry = &index->buckets[bucket];
+        if (*entry == -1 || sameConstant(constants->values[*entry], value)) return entry;
+        bucket = (bucket + 1) & (index->capacity - 1);
+    }
+}
+
+static void growConstantIndex(Chunk* chunk)
+{
+    ConstantIndex* index = &chunk->constantIndex;
+    int capacity = GROW_CAPACITY(index->capacity);
+    int* buckets = ALLOCATE(int, capacity);
+    for (int i = 0; i < capacity; ++i) buckets[i] = -1;
+
+    FREE_ARRAY(int, index->buckets, index->capacity);
+    index->buckets = buckets;
+    index->capacity = capacity;
+
+    for (int i = 0; i < index->count; ++i)
+    {
+        *findConstant(index, &chunk->constants, chunk->constants.values[i]) = i;
+    }
+}
+
 int addConstant(Chunk* chunk, Value value)
 {
-    if (IS_STRING(value))
+    ConstantIndex* index = &chunk->constantIndex;
+
+    // Growing the index or the constant array can trigger a collection.
+    push(value);
+    if (index->capacity * CONSTANT_INDEX_MAX_LOAD < index->count + 1) growConstantIndex(chunk);
+
+    int* entry = findConstant(index, &chunk->constants, value);
+    if (*entry == -1)
     {
-        for (int i = 0; i < chunk->constants.count; ++i)
-        {
-            Value* values = chunk->constants.values;
-            if (IS_STRING(values[i]) && AS_STRING(values[i]) == AS_STRING(value))
-            {
-                return i;
-            }
+        writeValueArray(&chunk->constants, value);
+        *entry = chunk->constants.count - 1;
+        index->count++;
+    }
+    pop();
+    return *entry;
+}
+
+static const uint8_t operandBytes[] = {
+#define OPCODE_OPERANDS(name, operands) operands,
+    OPCODE_LIST(OPCODE_OPERANDS)
+#undef OPCODE_OPERANDS
+};
+
+int instructionLength(uint8_t instruction)
+{
+    return 1 + operandBytes[instruction];
+}
+
+int jumpTarget(Chunk* chunk, int offset)
+{
+    uint8_t instruction = chunk->code[offset];
+    switch (instruction)
+    {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_OR_POP:
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+        case OP_LESS_LOCAL_CONSTANT_JUMP_OR_POP:
+        case OP_INLINE_CALL:
+        case OP_LOOP: {
+            // The jump distance is always the last two operand bytes.
+            int end = offset + instructionLength(instruction);
+            uint16_t jump = (uint16_t)(chunk->code[end - 2] << 8 | chunk->code[end - 1]);
+            return instruction == OP_LOOP ? end - jump : end + jump;
         }
+        default:
+            return -1;
     }
-    writeValueArray(&chunk->constants, value);
-    return chunk->constants.count - 1;
 }
 
+int readLongOperand(const uint8_t* operand)
+{
+    return operand[0] << 16 | operand[1] << 8 | operand[2];
+}
@@ -6,40 +6,110 @@
 #include "value.h"
 #include "line.h"
 
+// Every opcode, listed once with the number of operand bytes that follow
+// it. Expand with an X(name, operands) macro to build the OpCode enum,
+// dispatch tables or name tables from the same list.
+//
+// The _LONG variants take a 24-bit big-endian operand, for constant and
+// global indexes that do not fit in a byte.
+//
+// OP_CALL_0 to OP_CALL_3 are OP_CALL for the common argument counts, with
+// the count in the opcode instead of an operand. OP_TAIL_CALL is a call in
+// return position: a Lox function takes over the caller's frame. The
+// OP_RETURN after it still returns whatever a native call produced.
+//
+// OP_INLINE_CALL argCount, constant, jump starts a call whose callee was
+// compiled in place (see inlineCall() in compiler.c). When the callee is
+// the function in the constant, the arguments move down over it and the
+// instruction jumps to the body. The body copies arguments with OP_PEEK,
+// and OP_POP_UNDER drops those left below the result. Any other callee
+// falls through to a real call and a jump over the body.
+//
+// The opcodes after OP_RETURN are superinstructions that the compiler
+// fuses from common sequences (see fuseInstructions() in compiler.c) or
+// that the peephole optimizer introduces (see optimizer.c).
+//
+// The opcodes after OP_NOT_EQUAL are never compiled. run() quickens a
+// generic instruction into one of them after seeing its operand types.
+// When other types come along, the instruction becomes a polymorphic one,
+// which works like the generic one but is never quickened again.
+#define OPCODE_LIST(X) \
+    X(OP_CONSTANT, 1) \
+    X(OP_CONSTANT_LONG, 3) \
+    X(OP_NIL, 0) \
+    X(OP_TRUE, 0) \
+    X(OP_FALSE, 0) \
+    X(OP_EQUAL, 0) \
+    X(OP_GREATER, 0) \
+    X(OP_LESS, 0) \
+    X(OP_NEGATE, 0) \
+    X(OP_PRINT, 0) \
+    X(OP_ADD, 0) \
+    X(OP_SUBSTRACT, 0) \
+    X(OP_MULTIPLY, 0) \
+    X(OP_DIVIDE, 0) \
+    X(OP_NOT, 0) \
+    X(OP_POP, 0) \
+    X(OP_DEFINE_GLOBAL, 1) \
+    X(OP_DEFINE_GLOBAL_LONG, 3) \
+    X(OP_JUMP_IF_FALSE, 2) \
+    X(OP_JUMP, 2) \
+    X(OP_LOOP, 2) \
+    X(OP_CALL, 1) \
+    X(OP_CALL_0, 0) \
+    X(OP_CALL_1, 0) \
+    X(OP_CALL_2, 0) \
+    X(OP_CALL_3, 0) \
+    X(OP_TAIL_CALL, 1) \
+    X(OP_INLINE_CALL, 4) \
+    X(OP_PEEK, 1) \
+    X(OP_POP_UNDER, 1) \
+    X(OP_GET_GLOBAL, 1) \
+    X(OP_GET_GLOBAL_LONG, 3) \
+    X(OP_SET_GLOBAL, 1) \
+    X(OP_SET_GLOBAL_LONG, 3) \
+    X(OP_GET_LOCAL, 1) \
+    X(OP_SET_LOCAL, 1) \
+    X(OP_RETURN, 0) \
+    X(OP_ADD_LOCALS, 2) \
+    X(OP_ADD_LOCAL_CONSTANT, 2) \
+    X(OP_LESS_LOCAL_CONSTANT, 2) \
+    X(OP_LESS_LOCAL_CONSTANT_JUMP, 4) \
+    X(OP_LESS_LOCAL_CONSTANT_JUMP_OR_POP, 4) \
+    X(OP_JUMP_IF_FALSE_OR_POP, 2) \
+    X(OP_SET_LOCAL_POP, 1) \
+    X(OP_INCREMENT_LOCAL, 2) \
+    X(OP_POPN, 1) \
+    X(OP_NOT_EQUAL, 0) \
+    X(OP_ADD_NUMBER, 0) \
+    X(OP_ADD_STRING, 0) \
+    X(OP_ADD_LOCALS_NUMBER, 2) \
+    X(OP_ADD_POLYMORPHIC, 0) \
+    X(OP_ADD_LOCALS_POLYMORPHIC, 2)
+
 typedef enum {
-    OP_CONSTANT,
-    OP_NIL,
-    OP_TRUE,
-    OP_FALSE,
-    OP_EQUAL,
-    OP_GREATER,
-    OP_LESS,
-    OP_NEGATE,
-    OP_PRINT,
-    OP_ADD,
-    OP_SUBSTRACT,
-    OP_MULTIPLY,
-    OP_DIVIDE,
-    OP_NOT,
-    OP_POP,
-    OP_DEFINE_GLOBAL,
-    OP_JUMP_IF_FALSE,
-    OP_JUMP,
-    OP_LOOP,
-    OP_CALL,
-    OP_GET_GLOBAL,
-    OP_SET_GLOBAL,
-    OP_GET_LOCAL,
-    OP_SET_LOCAL,
-    OP_RETURN,
+#define OPCODE_ENUM(name, operands) name,
+    OPCODE_LIST(OPCODE_ENUM)
+#undef OPCODE_ENUM
+    OP_COUNT,
 } OpCode;
 
 
+// Open-addressed hash index over a chunk's constants, so addConstant()
+// can find an identical constant without scanning. Buckets hold indexes
+// into the constant array, or -1 when empty.
+typedef struct {
+    int count;
+    int capacity;
+    int* buckets;
+} ConstantIndex;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
     ValueArray constants;
+    ConstantIndex constantIndex;
     LineArray lines;
 } Chunk;
 
@@ -48,6 +118,11 @@ typedef struct {
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void truncateChunk(Chunk* chunk, int count);
 int addConstant(Chunk* chunk, Value value);
+int readLongOperand(const uint8_t* operand);
+int instructionLength(uint8_t instruction);
+// Offset a jump instruction transfers control to, or -1 for other opcodes.
+int jumpTarget(Chunk* chunk, int offset);
 
 #endif
@@ -8,6 +8,73 @@
 
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
+// #define DEBUG_STRESS_GC
+// #define DEBUG_LOG_GC
+
+// Count executed opcode pairs and triples and print the most frequent
+// ones when the VM shuts down, to pick superinstruction candidates.
+// #define DEBUG_PROFILE_OPCODES
+
+// Count the instructions each run executes and print the total with the
+// run time, to compare the backends. Also selectable with scons count=1.
+// #define COUNT_INSTRUCTIONS
+
+// Pack every Value into a single 64-bit NaN-boxed word instead of a
+// tagged struct. Also selectable with scons nan_boxing=1.
+// #define NAN_BOXING
+
+// Threaded dispatch in run() needs the labels-as-values extension.
+// Build with -DNO_COMPUTED_GOTO to force the portable switch.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Run the peephole optimizer over every chunk once it is compiled.
+// Build with -DNO_OPTIMIZE_BYTECODE to hand the raw chunk to the VM.
+#ifndef NO_OPTIMIZE_BYTECODE
+#define OPTIMIZE_BYTECODE
+#endif
+
+// Let run() rewrite generic instructions into variants specialized for
+// the operand types it meets there. Build with -DNO_QUICKENING to run the
+// chunks exactly as compiled.
+#ifndef NO_QUICKENING
+#define QUICKENING
+#endif
+
+// Compile calls to small leaf functions declared at the top of a module
+// into the callee's body, guarded by a check that the callee is still
+// that function. INLINE_BODY_MAX is the most bytecode, return excluded,
+// that a body may have. Build with -DNO_INLINING to always emit calls.
+#ifndef NO_INLINING
+#define INLINING
+#endif
+#ifndef INLINE_BODY_MAX
+#define INLINE_BODY_MAX 16
+#endif
+
+// Probe hash table groups with SSE2 when the target has it. Build with
+// -DNO_SSE2 to use the portable byte loops instead.
+#if defined(__SSE2__) && !defined(NO_SSE2)
+#define USE_SSE2
+#endif
+
+// Sources big enough to give several threads TOKENIZE_CHUNK_MIN bytes each
+// are scanned ahead of the parser on up to TOKENIZE_THREADS_MAX threads.
+// Build with -DNO_THREADS to always scan as the parser goes.
+#define TOKENIZE_CHUNK_MIN (256 * 1024)
+#define TOKENIZE_THREADS_MAX 8
+
+// Imported modules are compiled on up to COMPILE_THREADS_MAX threads, each
+// with a VM of its own. -DNO_THREADS compiles them one after another.
+#define COMPILE_THREADS_MAX 8
+
+// Each thread has its own current VM and compiler state.
+#ifndef NO_THREADS
+#define THREAD_LOCAL _Thread_local
+#else
+#define THREAD_LOCAL
+#endif
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
@@ -1,6 +1,10 @@
 #include "chunk.h"
 #include "compiler.h"
+#include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
+#include "tokens.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -16,6 +20,20 @@ typedef struct
     Token previous;
     bool hadError;
     bool panicMode;
+
+    // Tokens are scanned as the parser asks for them, or read from tokens
+    // when the whole source was scanned ahead.
+    Scanner scanner;
+    TokenArray tokens;
+    int nextToken;
+
+    // Imports have to come ahead of every other declaration.
+    bool pastImports;
+
+    // Functions declared so far at the top level that calls may inline,
+    // indexed by global slot, or NULL.
+    ObjFunction** inlinable;
+    int inlinableCapacity;
 } Parser;
 
 typedef enum
@@ -52,6 +70,8 @@ typedef enum {
     TYPE_FUNCTION,
 } FunctionType;
 
+#define RECENT_INSTRUCTIONS 4
+
 typedef struct Compiler {
     struct Compiler* enclosing;
     ObjFunction* function;
@@ -60,13 +80,25 @@ typedef struct Compiler {
     Local locals[UINT8_COUNT];
     int localCount;
     int scopeDepth;
+
+    // Start offsets of the last few complete instructions, oldest first,
+    // used to recognise sequences that can be fused.
+    int recentInstructions[RECENT_INSTRUCTIONS];
+    int recentCount;
+    int pendingOperands;
+    // No jump lands past this offset, so instructions starting at or
+    // after it can be rewritten freely.
+    int jumpBarrier;
 } Compiler;
 
-Parser parser;
+// The compiler's state is per thread rather than held in a context object
+// passed around. compile() resets it, and a compile runs start to finish
+// on one thread for one VM, so VMs compiling in parallel stay apart.
+THREAD_LOCAL Parser parser;
 
-Compiler* current = NULL;
+THREAD_LOCAL Compiler* current = NULL;
 
-Chunk* compilingChunk;
+THREAD_LOCAL Chunk* compilingChunk;
 
 static Chunk* currentChunk()
 {
@@ -78,6 +110,8 @@ static void errorAt(Token* token, const char* message)
     if (parser.panicMode) return;
 
     parser.panicMode = true;
+    // Modules are compiled on several threads at once.
+    flockfile(stderr);
     fprintf(stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
@@ -88,6 +122,7 @@ static void errorAt(Token* token, const char* message)
         fprintf(stderr, " at '%.*s'", token->length, token->start);
     }
     fprintf(stderr, ": %s\n", message);
+    funlockfile(stderr);
     parser.hadError = true;
 }
 
@@ -101,12 +136,18 @@ static void errorAtCurrent(const char* message)
     errorAt(&parser.current, message); 
 }
 
+static Token nextToken()
+{
+    if (parser.tokens.count == 0) return scanToken(&parser.scanner);
+    return tokenAt(&parser.tokens, parser.nextToken++);
+}
+
 static void advance()
 {
     parser.previous = parser.current;
     for (;;)
     {
-        parser.current = scanToken();
+        parser.current = nextToken();
         if (parser.current.type != TOKEN_ERROR) break;
 
         errorAtCurrent(parser.current.start);
@@ -138,9 +179,29 @@ static bool match(TokenType type)
 }
 
 
+static void fuseInstructions();
+
 static void emitByte(uint8_t byte)
 {
+    if (current->pendingOperands == 0)
+    {
+        if (current->recentCount == RECENT_INSTRUCTIONS)
+        {
+            memmove(current->recentInstructions, current->recentInstructions + 1,
+                sizeof(int) * (RECENT_INSTRUCTIONS - 1));
+            current->recentCount--;
+        }
+        current->recentInstructions[current->recentCount++] = currentChunk()->count;
+        current->pendingOperands = instructionLength(byte) - 1;
+    }
+    else
+    {
+        current->pendingOperands--;
+    }
+
     writeChunk(currentChunk(), byte, parser.previous.line);
+
+    if (current->pendingOperands == 0) fuseInstructions();
 }
 
 static void emitBytes(uint8_t byte_1, uint8_t byte_2)
@@ -149,6 +210,115 @@ static void emitBytes(uint8_t byte_1, uint8_t byte_2)
     emitByte(byte_2);
 }
 
+// Returns the opcode of the instruction `back` positions from the end
+// (0 is the last one), or -1 if it is unknown or a jump may land on it.
+static int recentOp(int back)
+{
+    if (back >= current->recentCount) return -1;
+
+    int start = current->recentInstructions[current->recentCount - 1 - back];
+    if (back > 0 && start < current->jumpBarrier) return -1;
+    return currentChunk()->code[start];
+}
+
+static uint8_t* recentOperands(int back)
+{
+    return &currentChunk()->code[current->recentInstructions[current->recentCount - 1 - back] + 1];
+}
+
+// Replaces the last `count` instructions with `length` bytes of one fused
+// instruction.
+static void replaceRecent(int count, const uint8_t* bytes, int length)
+{
+    Chunk* chunk = currentChunk();
+    int start = current->recentInstructions[current->recentCount - count];
+    int line = parser.previous.line;
+
+    truncateChunk(chunk, start);
+    current->recentCount -= count - 1;
+    for (int i = 0; i < length; ++i) writeChunk(chunk, bytes[i], line);
+}
+
+static bool fuseOnce()
+{
+    switch (recentOp(0))
+    {
+        case OP_ADD:
+        case OP_LESS: {
+            if (recentOp(1) != OP_CONSTANT && recentOp(1) != OP_GET_LOCAL) return false;
+            if (recentOp(2) != OP_GET_LOCAL) return false;
+
+            uint8_t fused;
+            if (recentOp(1) == OP_GET_LOCAL)
+            {
+                if (recentOp(0) != OP_ADD) return false;
+                fused = OP_ADD_LOCALS;
+            }
+            else
+            {
+                fused = recentOp(0) == OP_ADD ? OP_ADD_LOCAL_CONSTANT : OP_LESS_LOCAL_CONSTANT;
+            }
+            uint8_t bytes[] = {fused, recentOperands(2)[0], recentOperands(1)[0]};
+            replaceRecent(3, bytes, 3);
+            return true;
+        }
+        case OP_JUMP_IF_FALSE: {
+            if (recentOp(1) != OP_LESS_LOCAL_CONSTANT) return false;
+
+            uint8_t* operands = recentOperands(1);
+            uint8_t bytes[] = {OP_LESS_LOCAL_CONSTANT_JUMP, operands[0], operands[1], 0xff, 0xff};
+            replaceRecent(2, bytes, 5);
+            return true;
+        }
+        case OP_POP: {
+            int previous = recentOp(1);
+            if (previous == -1) return false;
+
+            uint8_t* operands = recentOperands(1);
+            switch (previous)
+            {
+                case OP_SET_LOCAL: {
+                    uint8_t bytes[] = {OP_SET_LOCAL_POP, operands[0]};
+                    replaceRecent(2, bytes, 2);
+                    return true;
+                }
+                // The jump operand has not been patched yet. Fusing the
+                // following pop leaves it at the same offset.
+                case OP_JUMP_IF_FALSE: {
+                    uint8_t bytes[] = {OP_JUMP_IF_FALSE_OR_POP, operands[0], operands[1]};
+                    replaceRecent(2, bytes, 3);
+                    return true;
+                }
+                case OP_LESS_LOCAL_CONSTANT_JUMP: {
+                    uint8_t bytes[] = {OP_LESS_LOCAL_CONSTANT_JUMP_OR_POP,
+                        operands[0], operands[1], operands[2], operands[3]};
+                    replaceRecent(2, bytes, 5);
+                    return true;
+                }
+                default:
+                    return false;
+            }
+        }
+        case OP_SET_LOCAL_POP: {
+            if (recentOp(1) != OP_ADD_LOCAL_CONSTANT) return false;
+
+            uint8_t* add = recentOperands(1);
+            if (add[0] != recentOperands(0)[0]) return false;
+
+            uint8_t bytes[] = {OP_INCREMENT_LOCAL, add[0], add[1]};
+            replaceRecent(2, bytes, 3);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+static void fuseInstructions()
+{
+    while (fuseOnce());
+}
+
 static int emitJump(uint8_t instruction)
 {
     emitByte(instruction);
@@ -156,8 +326,15 @@ static int emitJump(uint8_t instruction)
     return currentChunk()->count - 2;
 }
 
+static int markJumpTarget()
+{
+    current->jumpBarrier = currentChunk()->count;
+    return current->jumpBarrier;
+}
+
 static void patchJump(int offset)
 {
+    markJumpTarget();
     int jump = currentChunk()->count - offset - 2;
     if (jump > UINT16_MAX)
     {
@@ -184,15 +361,32 @@ static void emitReturn()
     emitByte(OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value)
+#define LONG_OPERAND_MAX 0xffffff
+
+static int makeConstant(Value value)
 {
-    int constantCount = addConstant(currentChunk(), value);
-    if (constantCount > UINT8_MAX)
+    int constant = addConstant(currentChunk(), value);
+    if (constant > LONG_OPERAND_MAX)
     {
-        error("Too many arguments in one chunk.");
+        error("Too many constants in one chunk.");
         return 0;
     }
-    return (uint8_t)constantCount;
+    return constant;
+}
+
+// Emits the one-byte form of an instruction when its operand fits, and
+// the 24-bit _LONG form otherwise.
+static void emitIndexed(uint8_t shortOp, uint8_t longOp, int operand)
+{
+    if (operand <= UINT8_MAX)
+    {
+        emitBytes(shortOp, (uint8_t)operand);
+        return;
+    }
+    emitByte(longOp);
+    emitByte((operand >> 16) & 0xff);
+    emitByte((operand >> 8) & 0xff);
+    emitByte(operand & 0xff);
 }
 
 static void markInitialized()
@@ -201,9 +395,15 @@ static void markInitialized()
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static uint8_t makeIdentifierConstant(Token* token)
+static int makeIdentifierSlot(Token* token)
 {
-    return makeConstant(OBJ_VAL(copyString(token->start, token->length)));
+    int slot = globalSlot(copyString(token->start, token->length));
+    if (slot > LONG_OPERAND_MAX)
+    {
+        error("Too many global variables.");
+        return 0;
+    }
+    return slot;
 }
 
 static bool identifierEquals(Token* a, Token* b)
@@ -268,7 +468,7 @@ static void declareVariable()
 
 static void emitConstant(Value value)
 {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitIndexed(OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(value));
 }
 
 
@@ -279,6 +479,9 @@ static void initCompiler(Compiler* compiler, FunctionType type)
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->recentCount = 0;
+    compiler->pendingOperands = 0;
+    compiler->jumpBarrier = 0;
     compiler->function = newFunction();
 
     current = compiler;
@@ -297,7 +500,10 @@ static ObjFunction* endCompiler()
 {
     emitReturn();
     ObjFunction* function = current->function;
-
+#ifdef OPTIMIZE_BYTECODE
+    if (!parser.hadError) optimizeChunk(currentChunk());
+#endif
+    finalizeLineArray(&currentChunk()->lines);
 
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError)
@@ -334,6 +540,117 @@ static void varDeclaration();
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 
+// Reads the literal pushed by the instruction `back` positions from the
+// end, as long as no jump can land between it and the end of the chunk.
+static bool recentConstant(int back, Value* value)
+{
+    if (back >= current->recentCount) return false;
+
+    int start = current->recentInstructions[current->recentCount - 1 - back];
+    if (start < current->jumpBarrier) return false;
+
+    Chunk* chunk = currentChunk();
+    switch (chunk->code[start])
+    {
+        case OP_CONSTANT: *value = chunk->constants.values[chunk->code[start + 1]]; return true;
+        case OP_CONSTANT_LONG:
+            *value = chunk->constants.values[readLongOperand(&chunk->code[start + 1])];
+            return true;
+        case OP_NIL: *value = NIL_VAL; return true;
+        case OP_TRUE: *value = BOOL_VAL(true); return true;
+        case OP_FALSE: *value = BOOL_VAL(false); return true;
+        default:
+            return false;
+    }
+}
+
+// Drops the last `count` instructions and pushes `value` in their place.
+static void replaceWithConstant(int count, Value value)
+{
+    truncateChunk(currentChunk(), current->recentInstructions[current->recentCount - count]);
+    current->recentCount -= count;
+
+    if (IS_BOOL(value))
+    {
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    }
+    else
+    {
+        emitConstant(value);
+    }
+}
+
+static bool isFalseyConstant(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static bool foldBinary(TokenType operatorType)
+{
+    Value a;
+    Value b;
+    if (!recentConstant(1, &a) || !recentConstant(0, &b)) return false;
+
+    Value result;
+    switch (operatorType)
+    {
+        case TOKEN_EQUAL_EQUAL: result = BOOL_VAL(valuesEqual(a, b)); break;
+        case TOKEN_BANG_EQUAL: result = BOOL_VAL(!valuesEqual(a, b)); break;
+        case TOKEN_PLUS:
+            if (IS_ANY_STRING(a) && IS_ANY_STRING(b))
+            {
+                // Both operands are constants of the function being
+                // compiled, so they stay reachable while concatenating.
+                // Constants are never ropes.
+                result = concatenateValues(a, b);
+                if (IS_ROPE(result)) result = OBJ_VAL(flattenRope(AS_ROPE(result)));
+                break;
+            }
+            // fallthrough
+        default: {
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+            double x = AS_NUMBER(a);
+            double y = AS_NUMBER(b);
+            switch (operatorType)
+            {
+                case TOKEN_PLUS: result = NUMBER_VAL(x + y); break;
+                case TOKEN_MINUS: result = NUMBER_VAL(x - y); break;
+                case TOKEN_STAR: result = NUMBER_VAL(x * y); break;
+                case TOKEN_SLASH: result = NUMBER_VAL(x / y); break;
+                case TOKEN_GREATER: result = BOOL_VAL(x > y); break;
+                case TOKEN_GREATER_EQUAL: result = BOOL_VAL(!(x < y)); break;
+                case TOKEN_LESS: result = BOOL_VAL(x < y); break;
+                case TOKEN_LESS_EQUAL: result = BOOL_VAL(!(x > y)); break;
+                default:
+                    return false;
+            }
+        }
+    }
+
+    replaceWithConstant(2, result);
+    return true;
+}
+
+static bool foldUnary(TokenType operatorType)
+{
+    Value operand;
+    if (!recentConstant(0, &operand)) return false;
+
+    switch (operatorType)
+    {
+        case TOKEN_MINUS:
+            if (!IS_NUMBER(operand)) return false;
+            replaceWithConstant(1, NUMBER_VAL(-AS_NUMBER(operand)));
+            return true;
+        case TOKEN_BANG:
+            replaceWithConstant(1, BOOL_VAL(isFalseyConstant(operand)));
+            return true;
+        default:
+            return false;
+    }
+}
+
 static void binary(bool canAssign)
 {
     TokenType operatorType = parser.previous.type;
@@ -341,9 +658,12 @@ static void binary(bool canAssign)
     ParseRule* rule = getRule(operatorType);
     parsePrecedence((Precedence)rule->precedence + 1);
 
+    if (foldBinary(operatorType)) return;
+
     switch (operatorType)
     {
         case TOKEN_EQUAL_EQUAL: emitByte(OP_EQUAL); break;
+        case TOKEN_BANG_EQUAL: emitBytes(OP_EQUAL, OP_NOT); break;
         case TOKEN_GREATER: emitByte(OP_GREATER); break;
         case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
         case TOKEN_LESS: emitByte(OP_LESS); break;
@@ -376,10 +696,254 @@ static uint8_t argumentList()
     return argCount;
 }
 
+static void emitCall(uint8_t argCount)
+{
+    if (argCount <= 3)
+    {
+        emitByte(OP_CALL_0 + argCount);
+    }
+    else
+    {
+        emitBytes(OP_CALL, argCount);
+    }
+}
+
+// Whether function is small enough to inline and straight-line code over
+// its parameters, constants and globals, so that it makes no calls.
+static bool isInlinable(ObjFunction* function)
+{
+    if (function->arity + INLINE_BODY_MAX > UINT8_MAX) return false;
+
+    Chunk* chunk = &function->chunk;
+    int depth = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk->code[offset]))
+    {
+        uint8_t* operands = &chunk->code[offset + 1];
+        switch (chunk->code[offset])
+        {
+            case OP_RETURN:
+                return depth == 1;
+            case OP_GET_LOCAL:
+                if (operands[0] == 0 || operands[0] > function->arity) return false;
+                depth++;
+                break;
+            case OP_ADD_LOCALS:
+                if (operands[0] == 0 || operands[0] > function->arity) return false;
+                if (operands[1] == 0 || operands[1] > function->arity) return false;
+                depth++;
+                break;
+            case OP_ADD_LOCAL_CONSTANT:
+            case OP_LESS_LOCAL_CONSTANT:
+                if (operands[0] == 0 || operands[0] > function->arity) return false;
+                depth++;
+                break;
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG:
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+            case OP_GET_GLOBAL:
+            case OP_GET_GLOBAL_LONG:
+                depth++;
+                break;
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_ADD:
+            case OP_SUBSTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+                depth--;
+                break;
+            case OP_NEGATE:
+            case OP_NOT:
+                break;
+            default:
+                return false;
+        }
+        if (offset + instructionLength(chunk->code[offset]) > INLINE_BODY_MAX) return false;
+    }
+    return false;
+}
+
+static void recordFunction(int global, ObjFunction* function)
+{
+    if (global >= parser.inlinableCapacity)
+    {
+        int oldCapacity = parser.inlinableCapacity;
+        parser.inlinableCapacity = GROW_CAPACITY(oldCapacity);
+        while (parser.inlinableCapacity <= global) parser.inlinableCapacity *= 2;
+        parser.inlinable = GROW_ARRAY(ObjFunction*, parser.inlinable, oldCapacity, parser.inlinableCapacity);
+        for (int i = oldCapacity; i < parser.inlinableCapacity; ++i) parser.inlinable[i] = NULL;
+    }
+    // A later declaration of the same name replaces the candidate.
+    parser.inlinable[global] = isInlinable(function) ? function : NULL;
+}
+
+#ifdef INLINING
+// The function a call is known to reach when its callee is a global
+// declared with an inlinable function, or NULL.
+static ObjFunction* inlineCandidate()
+{
+    int op = recentOp(0);
+    if (op != OP_GET_GLOBAL && op != OP_GET_GLOBAL_LONG) return NULL;
+
+    uint8_t* operands = recentOperands(0);
+    int global = op == OP_GET_GLOBAL ? operands[0] : readLongOperand(operands);
+    return global < parser.inlinableCapacity ? parser.inlinable[global] : NULL;
+}
+
+// One step of an inlined body, with fused instructions taken apart.
+typedef struct {
+    uint8_t op;
+    int operand;
+} InlineStep;
+
+// A body never has more steps than bytes.
+static int inlineSteps(ObjFunction* function, InlineStep* steps)
+{
+    Chunk* chunk = &function->chunk;
+    int count = 0;
+    for (int offset = 0; chunk->code[offset] != OP_RETURN; offset += instructionLength(chunk->code[offset]))
+    {
+        uint8_t op = chunk->code[offset];
+        uint8_t* operands = &chunk->code[offset + 1];
+        switch (op)
+        {
+            case OP_CONSTANT:
+            case OP_GET_GLOBAL:
+            case OP_GET_LOCAL:
+                steps[count++] = (InlineStep){op, operands[0]};
+                break;
+            case OP_CONSTANT_LONG:
+                steps[count++] = (InlineStep){OP_CONSTANT, readLongOperand(operands)};
+                break;
+            case OP_GET_GLOBAL_LONG:
+                steps[count++] = (InlineStep){OP_GET_GLOBAL, readLongOperand(operands)};
+                break;
+            case OP_ADD_LOCALS:
+                steps[count++] = (InlineStep){OP_GET_LOCAL, operands[0]};
+                steps[count++] = (InlineStep){OP_GET_LOCAL, operands[1]};
+                steps[count++] = (InlineStep){OP_ADD, 0};
+                break;
+            case OP_ADD_LOCAL_CONSTANT:
+            case OP_LESS_LOCAL_CONSTANT:
+                steps[count++] = (InlineStep){OP_GET_LOCAL, operands[0]};
+                steps[count++] = (InlineStep){OP_CONSTANT, operands[1]};
+                steps[count++] = (InlineStep){op == OP_ADD_LOCAL_CONSTANT ? OP_ADD : OP_LESS, 0};
+                break;
+            default:
+                steps[count++] = (InlineStep){op, 0};
+                break;
+        }
+    }
+    return count;
+}
+
+// Replays the steps of function's body over the arguments, which
+// OP_INLINE_CALL leaves on the stack. In place, the steps that start the
+// body by reading each parameter in order are the arguments themselves.
+// Otherwise the arguments stay below the body, which copies them with
+// OP_PEEK, and OP_POP_UNDER drops them at the end. holds[] has the
+// parameter each slot still holds, or 0. Returns false, before emitting
+// anything when emit is false, if a read finds its argument gone.
+static bool emitInlineSteps(ObjFunction* function, InlineStep* steps, int count, uint8_t argCount,
+                            bool inPlace, bool emit)
+{
+    uint8_t holds[UINT8_COUNT];
+    int depth = argCount;
+    for (int i = 0; i < argCount; ++i) holds[i] = (uint8_t)(i + 1);
+
+    int first = 0;
+    if (inPlace)
+    {
+        for (; first < argCount; ++first)
+        {
+            if (first >= count || steps[first].op != OP_GET_LOCAL || steps[first].operand != first + 1) return false;
+        }
+    }
+
+    for (int i = first; i < count; ++i)
+    {
+        InlineStep* step = &steps[i];
+        switch (step->op)
+        {
+            case OP_GET_LOCAL: {
+                int slot = depth - 1;
+                while (slot >= 0 && holds[slot] != step->operand) slot--;
+                if (slot < 0) return false;
+                if (emit) emitBytes(OP_PEEK, (uint8_t)(depth - 1 - slot));
+                holds[depth++] = (uint8_t)step->operand;
+                break;
+            }
+            case OP_CONSTANT:
+                if (emit) emitConstant(function->chunk.constants.values[step->operand]);
+                holds[depth++] = 0;
+                break;
+            case OP_GET_GLOBAL:
+                if (emit) emitIndexed(OP_GET_GLOBAL, OP_GET_GLOBAL_LONG, step->operand);
+                holds[depth++] = 0;
+                break;
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                if (emit) emitByte(step->op);
+                holds[depth++] = 0;
+                break;
+            case OP_NEGATE:
+            case OP_NOT:
+                if (emit) emitByte(step->op);
+                holds[depth - 1] = 0;
+                break;
+            default:
+                if (emit) emitByte(step->op);
+                depth--;
+                holds[depth - 1] = 0;
+                break;
+        }
+    }
+
+    if (emit && depth > 1) emitBytes(OP_POP_UNDER, (uint8_t)(depth - 1));
+    return true;
+}
+
+// Compiles function's body in place of the call. OP_INLINE_CALL jumps to
+// it when the callee is still function by the time the call runs, and
+// falls through to a real call otherwise.
+static bool inlineCall(ObjFunction* function, uint8_t argCount)
+{
+    int expected = makeConstant(OBJ_VAL(function));
+    if (expected > UINT8_MAX) return false;
+
+    InlineStep steps[INLINE_BODY_MAX + 1];
+    int count = inlineSteps(function, steps);
+    bool inPlace = emitInlineSteps(function, steps, count, argCount, true, false);
+
+    emitBytes(OP_INLINE_CALL, argCount);
+    emitByte((uint8_t)expected);
+    emitBytes(0xff, 0xff);
+    int body = currentChunk()->count - 2;
+    emitCall(argCount);
+    int end = emitJump(OP_JUMP);
+
+    patchJump(body);
+    emitInlineSteps(function, steps, count, argCount, inPlace, true);
+    patchJump(end);
+    return true;
+}
+#endif
+
 static void call(bool canAssign)
 {
+#ifdef INLINING
+    ObjFunction* inlined = inlineCandidate();
+    uint8_t argCount = argumentList();
+    if (inlined != NULL && inlined->arity == argCount && inlineCall(inlined, argCount)) return;
+#else
     uint8_t argCount = argumentList();
-    emitBytes(OP_CALL, argCount);
+#endif
+    emitCall(argCount);
 }
 
 static void literal(bool canAssign)
@@ -400,6 +964,8 @@ static void unary(bool canAssign)
     
     parsePrecedence(PREC_UNARY);
 
+    if (foldUnary(operatorType)) return;
+
     switch (operatorType)
     {
         case TOKEN_MINUS: emitByte(OP_NEGATE); break;
@@ -415,7 +981,7 @@ static void or_(bool canAssign)
     int endJump = emitJump(OP_JUMP);
 
     patchJump(elseJump);
-    emitJump(OP_POP);
+    emitByte(OP_POP);
 
     parsePrecedence(PREC_OR);
     patchJump(endJump);
@@ -444,13 +1010,14 @@ static void number(bool canAssign)
 
 static void string(bool canAssign)
 {
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+    emitConstant(copyStringValue(parser.previous.start + 1, parser.previous.length - 2));
 }
 
 static void namedVariable(Token name, bool canAssign)
 {
     uint8_t getOp;
     uint8_t setOp;
+    bool isGlobal = false;
 
     int arg = resolveLocal(current, &name);
 
@@ -461,19 +1028,22 @@ static void namedVariable(Token name, bool canAssign)
     }
     else
     {
-        arg = makeIdentifierConstant(&name);
+        arg = makeIdentifierSlot(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
+        isGlobal = true;
     }
 
     if (canAssign && match(TOKEN_EQUAL))
     {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        if (isGlobal) emitIndexed(setOp, OP_SET_GLOBAL_LONG, arg);
+        else emitBytes(setOp, (uint8_t)arg);
     }
     else
     {
-        emitBytes(getOp, (uint8_t)arg);
+        if (isGlobal) emitIndexed(getOp, OP_GET_GLOBAL_LONG, arg);
+        else emitBytes(getOp, (uint8_t)arg);
     }
 }
 
@@ -495,7 +1065,7 @@ ParseRule rules[] = {
     [TOKEN_SLASH]         = {NULL,     binary, PREC_FACTOR},
     [TOKEN_STAR]          = {NULL,     binary, PREC_FACTOR},
     [TOKEN_BANG]          = {unary,     NULL,   PREC_UNARY},
-    [TOKEN_BANG_EQUAL]    = {NULL,     NULL,   PREC_EQUALITY},
+    [TOKEN_BANG_EQUAL]    = {NULL,     binary,   PREC_EQUALITY},
     [TOKEN_EQUAL]         = {NULL,     NULL,   PREC_NONE},
     [TOKEN_EQUAL_EQUAL]   = {NULL,     binary,   PREC_EQUALITY},
     [TOKEN_GREATER]       = {NULL,     binary,   PREC_COMPARISON},
@@ -512,6 +1082,7 @@ ParseRule rules[] = {
     [TOKEN_FOR]           = {NULL,     NULL,   PREC_NONE},
     [TOKEN_FUN]           = {NULL,     NULL,   PREC_NONE},
     [TOKEN_IF]            = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_IMPORT]        = {NULL,     NULL,   PREC_NONE},
     [TOKEN_NIL]           = {literal,     NULL,   PREC_NONE},
     [TOKEN_OR]            = {NULL,     or_,   PREC_OR},
     [TOKEN_PRINT]         = {NULL,     NULL,   PREC_NONE},
@@ -570,10 +1141,10 @@ static void blockStatement()
     consume(TOKEN_RIGHT_BRACE, "Expect closing '}' after block.");
 }
 
-static uint8_t parseVariable(const char* message);
-static void defineVariable(uint8_t global);
+static int parseVariable(const char* message);
+static void defineVariable(int global);
 
-static void function(FunctionType type)
+static ObjFunction* function(FunctionType type)
 {
     Compiler compiler;
     initCompiler(&compiler, type);
@@ -587,7 +1158,7 @@ static void function(FunctionType type)
             {
                 errorAtCurrent("Cannot have more than 255 parameters.");
             }
-            uint8_t paramConstant = parseVariable("Expect parameter value");
+            int paramConstant = parseVariable("Expect parameter value");
             defineVariable(paramConstant);
         } while (match(TOKEN_COMMA));
     }
@@ -598,15 +1169,16 @@ static void function(FunctionType type)
 
     ObjFunction* function = endCompiler();
 
-    emitBytes(OP_CONSTANT, makeConstant(OBJ_VAL(function)));
-
+    emitConstant(OBJ_VAL(function));
+    return function;
 }
 
 static void funDeclaration()
 {
-    uint8_t global = parseVariable("Expect function name.");
+    int global = parseVariable("Expect function name.");
     markInitialized();
-    function(TYPE_FUNCTION);
+    ObjFunction* declared = function(TYPE_FUNCTION);
+    if (current->scopeDepth == 0) recordFunction(global, declared);
     defineVariable(global);
 }
 
@@ -635,7 +1207,7 @@ static void forStatement()
         expressionStatement();
     }
 
-    int loopStart = currentChunk()->count;
+    int loopStart = markJumpTarget();
     int exitJump = -1;
     if (!match(TOKEN_SEMICOLON))
     {
@@ -650,7 +1222,7 @@ static void forStatement()
     {
         int bodyJump = emitJump(OP_JUMP);
 
-        int incrementStart = currentChunk()->count;
+        int incrementStart = markJumpTarget();
         expression();
         emitByte(OP_POP);
         consume(TOKEN_RIGHT_PAREN, "Expect closing ')' after for condition.");
@@ -676,7 +1248,7 @@ static void forStatement()
 
 static void whileStatement()
 {
-    int loopStart = currentChunk()->count;
+    int loopStart = markJumpTarget();
 
     consume(TOKEN_LEFT_PAREN, "Expect opening '(' after while keyword.");
     expression();
@@ -729,6 +1301,7 @@ static void synchronize()
         {
             case TOKEN_CLASS:
             case TOKEN_FUN:
+            case TOKEN_IMPORT:
             case TOKEN_VAR:
             case TOKEN_FOR:
             case TOKEN_IF:
@@ -745,30 +1318,30 @@ static void synchronize()
     }
 }
 
-static void defineVariable(uint8_t global)
+static void defineVariable(int global)
 {
     if (current->scopeDepth > 0)
     {
         markInitialized();
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitIndexed(OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
 }
 
 
-static uint8_t parseVariable(const char* message)
+static int parseVariable(const char* message)
 {
     consume(TOKEN_IDENTIFIER, message);
 
     declareVariable();
     if (current->scopeDepth > 0) return 0;
 
-    return makeIdentifierConstant(&parser.previous);
+    return makeIdentifierSlot(&parser.previous);
 }
 
 static void varDeclaration()
 {
-    uint8_t global = parseVariable("Expect variable name");
+    int global = parseVariable("Expect variable name");
 
     if (match(TOKEN_EQUAL))
     {
@@ -783,6 +1356,21 @@ static void varDeclaration()
     defineVariable(global);
 }
 
+// Turns a call that ends the returned expression into a tail call. The
+// return stays behind it, for natives and for jumps that land there.
+static void emitTailCall()
+{
+    int op = recentOp(0);
+    if (op != OP_CALL && (op < OP_CALL_0 || op > OP_CALL_3)) return;
+
+    uint8_t argCount = op == OP_CALL ? recentOperands(0)[0] : (uint8_t)(op - OP_CALL_0);
+    // Growing a one-byte call would move the end that a jump lands on.
+    if (op != OP_CALL && current->jumpBarrier == currentChunk()->count) return;
+
+    uint8_t bytes[] = {OP_TAIL_CALL, argCount};
+    replaceRecent(1, bytes, 2);
+}
+
 static void returnStatement()
 {
     if (current->type == TYPE_SCRIPT)
@@ -797,6 +1385,7 @@ static void returnStatement()
     {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return statement");
+        emitTailCall();
         emitByte(OP_RETURN);
     }
 }
@@ -835,8 +1424,25 @@ static void statement()
     }
 }
 
+// The loader finds and binds the modules before the script runs, so
+// nothing is emitted.
+static void importDeclaration()
+{
+    if (parser.pastImports) error("Imports must come before any other statement.");
+    consume(TOKEN_STRING, "Expect module path after 'import'.");
+    consume(TOKEN_SEMICOLON, "Expect ';' after module path.");
+}
+
 static void declaration()
 {
+    if (match(TOKEN_IMPORT))
+    {
+        importDeclaration();
+        if (parser.panicMode) synchronize();
+        return;
+    }
+    parser.pastImports = true;
+
     if (match(TOKEN_VAR))
     {
         varDeclaration();
@@ -855,13 +1461,24 @@ static void declaration()
 
 ObjFunction* compile(const char* source)
 {
-    initScanner(source);
+    const char* end = source + strlen(source);
+    initScanner(&parser.scanner, source, end);
+    initTokenArray(&parser.tokens, source, end);
+    parser.nextToken = 0;
+#ifndef NO_THREADS
+    // Scanning ahead only pays for itself when the pieces run in parallel.
+    if (tokenizeThreads((int)(end - source)) > 1) tokenizeSource(&parser.tokens, source, end);
+#endif
+
     Compiler compiler;
     initCompiler(&compiler, TYPE_SCRIPT);
     // compilingChunk = chunk;
 
     parser.hadError = false;
     parser.panicMode = false;
+    parser.pastImports = false;
+    parser.inlinable = NULL;
+    parser.inlinableCapacity = 0;
 
     advance();
     while (!match(TOKEN_EOF))
@@ -871,6 +1488,18 @@ ObjFunction* compile(const char* source)
     consume(TOKEN_EOF, "Expect end of expression");
 
     ObjFunction* function = endCompiler();
-    
+    freeTokenArray(&parser.tokens);
+    FREE_ARRAY(ObjFunction*, parser.inlinable, parser.inlinableCapacity);
+
     return parser.hadError ? NULL : function;
 }
+
+void markCompilerRoots()
+{
+    Compiler* compiler = current;
+    while (compiler != NULL)
+    {
+        markObject((Obj*)compiler->function);
+        compiler = compiler->enclosing;
+    }
+}
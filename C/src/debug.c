@@ -1,4 +1,5 @@
 #include "debug.h"
+#include "vm.h"
 
 #include <stdio.h>
 
@@ -22,15 +23,92 @@ static int jumpInstruction(const char* name, int sign, Chunk const* chunk, int o
     return offset + 3;
 }
 
+static int globalInstruction(const char* name, Chunk const* chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    printf("%-16s %4d '", name, slot);
+    printValue(stdout, vm->modules[vm->module]->names.values[slot]);
+    printf("'\n");
+    return offset + 2;
+}
+
+static int longGlobalInstruction(const char* name, Chunk const* chunk, int offset)
+{
+    int slot = readLongOperand(&chunk->code[offset + 1]);
+    printf("%-16s %4d '", name, slot);
+    printValue(stdout, vm->modules[vm->module]->names.values[slot]);
+    printf("'\n");
+    return offset + 4;
+}
+
+static int longConstantInstruction(const char* name, Chunk const* chunk, int offset)
+{
+    int constant = readLongOperand(&chunk->code[offset + 1]);
+    printf("%-16s %4d '", name, constant);
+    printValue(stdout, chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
 static int constantInstruction(const char *name, Chunk const * chunk, int offset)
 {
     uint8_t constantOffset = chunk->code[offset + 1];
     printf("%-16s %4d '", name, constantOffset);
-    printValue(chunk->constants.values[constantOffset]);
+    printValue(stdout, chunk->constants.values[constantOffset]);
     printf("'\n");
     return offset + 2;
 }
 
+static int localConstantInstruction(const char* name, Chunk const* chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(stdout, chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static int localConstantJumpInstruction(const char* name, Chunk const* chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    uint16_t jump = (uint16_t)(chunk->code[offset + 3]) << 8 | (uint16_t)chunk->code[offset + 4];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(stdout, chunk->constants.values[constant]);
+    printf("' %4d -> %d\n", offset, offset + 5 + jump);
+    return offset + 5;
+}
+
+static int inlineCallInstruction(const char* name, Chunk const* chunk, int offset)
+{
+    uint8_t argCount = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    uint16_t jump = (uint16_t)(chunk->code[offset + 3]) << 8 | (uint16_t)chunk->code[offset + 4];
+    printf("%-16s %4d %4d '", name, argCount, constant);
+    printValue(stdout, chunk->constants.values[constant]);
+    printf("' %4d -> %d\n", offset, offset + 5 + jump);
+    return offset + 5;
+}
+
+static int twoByteInstruction(const char* name, Chunk const* chunk, int offset)
+{
+    printf("%-16s %4d %4d\n", name, chunk->code[offset + 1], chunk->code[offset + 2]);
+    return offset + 3;
+}
+
+const char* opcodeName(uint8_t instruction)
+{
+    static const char* names[] = {
+#define OPCODE_NAME(name, operands) #name,
+        OPCODE_LIST(OPCODE_NAME)
+#undef OPCODE_NAME
+    };
+
+    if (instruction >= OP_COUNT) return "OP_UNKNOWN";
+    return names[instruction];
+}
+
 void disassembleChunk(Chunk *chunk, char const * name)
 {
     printf("== %s ==\n", name);
@@ -47,16 +125,15 @@ int disassembleInstruction(Chunk* chunk, int offset)
 {
     printf("%04d ", offset);
 
-    Line previous = getLine(&chunk->lines, offset - 1);
-    Line current = getLine(&chunk->lines, offset);
+    int line = getLine(&chunk->lines, offset);
 
-    if (offset > 0 && previous.line == current.line)
+    if (offset > 0 && getLine(&chunk->lines, offset - 1) == line)
     {
         printf("   | ");
     }
     else
     {
-        printf("%4d ", current.line);
+        printf("%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
@@ -69,6 +146,8 @@ int disassembleInstruction(Chunk* chunk, int offset)
             return simpleInstruction("OP_RETURN", offset);
         case OP_CONSTANT:
             return constantInstruction("OP_CONSTANT", chunk, offset);
+        case OP_CONSTANT_LONG:
+            return longConstantInstruction("OP_CONSTANT_LONG", chunk, offset);
         case OP_NEGATE:
             return simpleInstruction("OP_NEGATE", offset);
         case OP_ADD      : return simpleInstruction("OP_ADD", offset); 
@@ -84,15 +163,43 @@ int disassembleInstruction(Chunk* chunk, int offset)
         case OP_LESS     : return simpleInstruction("OP_LESS", offset);
         case OP_PRINT    : return simpleInstruction("OP_PRINT", offset);
         case OP_POP      : return simpleInstruction("OP_POP", offset);
-        case OP_DEFINE_GLOBAL: return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset); break;
-        case OP_GET_GLOBAL: return constantInstruction("OP_GET_GLOBAL", chunk, offset); break;
-        case OP_SET_GLOBAL: return constantInstruction("OP_SET_GLOBAL", chunk, offset); break;
+        case OP_POPN     : return byteInstruction("OP_POPN", chunk, offset);
+        case OP_NOT_EQUAL: return simpleInstruction("OP_NOT_EQUAL", offset);
+        case OP_DEFINE_GLOBAL: return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset); break;
+        case OP_GET_GLOBAL: return globalInstruction("OP_GET_GLOBAL", chunk, offset); break;
+        case OP_SET_GLOBAL: return globalInstruction("OP_SET_GLOBAL", chunk, offset); break;
+        case OP_DEFINE_GLOBAL_LONG: return longGlobalInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+        case OP_GET_GLOBAL_LONG: return longGlobalInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+        case OP_SET_GLOBAL_LONG: return longGlobalInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
         case OP_GET_LOCAL: return byteInstruction("OP_GET_LOCAL", chunk, offset); break;
         case OP_SET_LOCAL: return byteInstruction("OP_SET_LOCAL", chunk, offset); break;
         case OP_JUMP:      return jumpInstruction("OP_JUMP", 1, chunk, offset); break;
         case OP_JUMP_IF_FALSE:      return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset); break;
         case OP_LOOP:   return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL: return byteInstruction("OP_CALL", chunk, offset); break;
+        case OP_CALL_0: return simpleInstruction("OP_CALL_0", offset);
+        case OP_CALL_1: return simpleInstruction("OP_CALL_1", offset);
+        case OP_CALL_2: return simpleInstruction("OP_CALL_2", offset);
+        case OP_CALL_3: return simpleInstruction("OP_CALL_3", offset);
+        case OP_TAIL_CALL: return byteInstruction("OP_TAIL_CALL", chunk, offset);
+        case OP_INLINE_CALL: return inlineCallInstruction("OP_INLINE_CALL", chunk, offset);
+        case OP_PEEK: return byteInstruction("OP_PEEK", chunk, offset);
+        case OP_POP_UNDER: return byteInstruction("OP_POP_UNDER", chunk, offset);
+        case OP_ADD_LOCALS: return twoByteInstruction("OP_ADD_LOCALS", chunk, offset);
+        case OP_ADD_LOCAL_CONSTANT: return localConstantInstruction("OP_ADD_LOCAL_CONSTANT", chunk, offset);
+        case OP_LESS_LOCAL_CONSTANT: return localConstantInstruction("OP_LESS_LOCAL_CONSTANT", chunk, offset);
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+            return localConstantJumpInstruction("OP_LESS_LOCAL_CONSTANT_JUMP", chunk, offset);
+        case OP_LESS_LOCAL_CONSTANT_JUMP_OR_POP:
+            return localConstantJumpInstruction("OP_LESS_LOCAL_CONSTANT_JUMP_OR_POP", chunk, offset);
+        case OP_JUMP_IF_FALSE_OR_POP: return jumpInstruction("OP_JUMP_IF_FALSE_OR_POP", 1, chunk, offset);
+        case OP_SET_LOCAL_POP: return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_INCREMENT_LOCAL: return localConstantInstruction("OP_INCREMENT_LOCAL", chunk, offset);
+        case OP_ADD_NUMBER: return simpleInstruction("OP_ADD_NUMBER", offset);
+        case OP_ADD_STRING: return simpleInstruction("OP_ADD_STRING", offset);
+        case OP_ADD_LOCALS_NUMBER: return twoByteInstruction("OP_ADD_LOCALS_NUMBER", chunk, offset);
+        case OP_ADD_POLYMORPHIC: return simpleInstruction("OP_ADD_POLYMORPHIC", offset);
+        case OP_ADD_LOCALS_POLYMORPHIC: return twoByteInstruction("OP_ADD_LOCALS_POLYMORPHIC", chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
@@ -100,3 +207,112 @@ int disassembleInstruction(Chunk* chunk, int offset)
 }
 
 
+
+static const char* registerOpcodeName(uint8_t instruction)
+{
+    static const char* names[] = {
+#define REGISTER_OPCODE_NAME(name, format) #name,
+        REGISTER_OPCODE_LIST(REGISTER_OPCODE_NAME)
+#undef REGISTER_OPCODE_NAME
+    };
+
+    if (instruction >= ROP_COUNT) return "ROP_UNKNOWN";
+    return names[instruction];
+}
+
+static void printConstant(ObjFunction* function, int constant)
+{
+    printf(" '");
+    printValue(stdout, function->chunk.constants.values[constant]);
+    printf("'");
+}
+
+void disassembleRegisterChunk(ObjFunction* function)
+{
+    const char* name = function->name != NULL ? function->name->chars : "<script>";
+    RegisterChunk* chunk = &function->registerChunk;
+
+    printf("== %s (%d registers) ==\n", name, chunk->registerCount);
+
+    for (int offset = 0; offset < chunk->count;)
+    {
+        offset = disassembleRegisterInstruction(function, offset);
+    }
+    printf("== end %s ==\n", name);
+}
+
+int disassembleRegisterInstruction(ObjFunction* function, int offset)
+{
+    RegisterChunk* chunk = &function->registerChunk;
+    printf("%04d ", offset);
+
+    int line = getLine(&chunk->lines, offset);
+
+    if (offset > 0 && getLine(&chunk->lines, offset - 1) == line)
+    {
+        printf("   | ");
+    }
+    else
+    {
+        printf("%4d ", line);
+    }
+
+    RegisterInstruction instruction = chunk->code[offset];
+    uint8_t op = REGISTER_OP(instruction);
+    int a = REGISTER_A(instruction);
+    int b = REGISTER_B(instruction);
+    int c = REGISTER_C(instruction);
+    int bx = REGISTER_BX(instruction);
+
+    printf("%-26s ", registerOpcodeName(op));
+
+    switch (registerFormat(op))
+    {
+        case FORMAT_A:      printf("r%d", a); break;
+        case FORMAT_SOURCE: printf("r%d", a); break;
+        case FORMAT_AB:     printf("r%d r%d", a, b); break;
+        case FORMAT_ABC:    printf("r%d r%d r%d", a, b, c); break;
+        case FORMAT_ABK:
+            printf("r%d r%d k%d", a, b, c);
+            printConstant(function, c);
+            break;
+        case FORMAT_AK:
+            printf("r%d k%d", a, bx);
+            printConstant(function, bx);
+            break;
+        case FORMAT_AK_LONG:
+            printf("r%d k%d", a, chunk->code[offset + 1]);
+            printConstant(function, chunk->code[offset + 1]);
+            break;
+        case FORMAT_AG:
+        case FORMAT_GLOBAL:
+            printf("r%d g%d '", a, bx);
+            printValue(stdout, vm->modules[function->module]->names.values[bx]);
+            printf("'");
+            break;
+        case FORMAT_AG_LONG:
+        case FORMAT_GLOBAL_LONG:
+            printf("r%d g%d '", a, chunk->code[offset + 1]);
+            printValue(stdout, vm->modules[function->module]->names.values[chunk->code[offset + 1]]);
+            printf("'");
+            break;
+        case FORMAT_CALL:   printf("r%d %d", a, b); break;
+        case FORMAT_INLINE_CALL:
+            printf("r%d %d k%d", a, b, c);
+            printConstant(function, c);
+            printf(" -> %d", chunk->code[offset + 1]);
+            break;
+        case FORMAT_JUMP:   printf("-> %d", chunk->code[offset + 1]); break;
+        case FORMAT_TEST:   printf("r%d -> %d", a, chunk->code[offset + 1]); break;
+        case FORMAT_COMPARE_JUMP:
+            printf("r%d r%d -> %d", b, c, chunk->code[offset + 1]);
+            break;
+        case FORMAT_COMPARE_K_JUMP:
+            printf("r%d k%d", b, c);
+            printConstant(function, c);
+            printf(" -> %d", chunk->code[offset + 1]);
+            break;
+    }
+    printf("\n");
+    return offset + registerInstructionLength(op);
+}
@@ -2,8 +2,13 @@
 #define clox_debug_h
 
 #include "chunk.h"
+#include "object.h"
 
 void disassembleChunk(Chunk* chunk, char const * name);
 int disassembleInstruction(Chunk* chunk, int offset);
+const char* opcodeName(uint8_t instruction);
+
+void disassembleRegisterChunk(ObjFunction* function);
+int disassembleRegisterInstruction(ObjFunction* function, int offset);
 
 #endif
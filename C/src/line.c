@@ -1,16 +1,24 @@
 #include "line.h"
 #include "memory.h"
 
+#define LINE_CHECKPOINT_INTERVAL 16
+
 void initLineArray(LineArray* array)
 {
     array->count = 0;
     array->capacity = 0;
     array->array = 0;
+    array->encodedCount = 0;
+    array->encoded = NULL;
+    array->checkpointCount = 0;
+    array->checkpoints = NULL;
 }
 
 void freeLineArray(LineArray* array)
 {
     FREE_ARRAY(Line, array->array, array->capacity);
+    FREE_ARRAY(uint8_t, array->encoded, array->encodedCount);
+    FREE_ARRAY(LineCheckpoint, array->checkpoints, array->checkpointCount);
     initLineArray(array);
 }
 
@@ -36,14 +44,145 @@ void writeLineArray(LineArray* lineArray, int byteOffset, int line)
 
 }
 
-Line getLine(LineArray* lineArray, int byteOffset)
+void truncateLineArray(LineArray* lineArray, int byteCount)
+{
+    while (lineArray->count > 0)
+    {
+        Line* last = &lineArray->array[lineArray->count - 1];
+        int start = lineArray->count > 1 ? lineArray->array[lineArray->count - 2].endingByteOffset + 1 : 0;
+
+        if (start < byteCount)
+        {
+            if (last->endingByteOffset >= byteCount) last->endingByteOffset = byteCount - 1;
+            return;
+        }
+        lineArray->count--;
+    }
+}
+
+static int writeVarint(uint8_t* out, uint32_t value)
+{
+    int size = 0;
+    while (value >= 0x80)
+    {
+        out[size++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[size++] = (uint8_t)value;
+    return size;
+}
+
+static uint32_t readVarint(const uint8_t* in, int* position)
+{
+    uint32_t value = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+        byte = in[(*position)++];
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return value;
+}
+
+void finalizeLineArray(LineArray* lineArray)
+{
+    if (lineArray->encoded != NULL || lineArray->count == 0) return;
+
+    // Two varints of at most five bytes each per run.
+    uint8_t* buffer = ALLOCATE(uint8_t, lineArray->count * 10);
+    int checkpointCount = (lineArray->count + LINE_CHECKPOINT_INTERVAL - 1) / LINE_CHECKPOINT_INTERVAL;
+    LineCheckpoint* checkpoints = ALLOCATE(LineCheckpoint, checkpointCount);
+
+    int size = 0;
+    int start = 0;
+    int previousLine = 0;
+    for (int i = 0; i < lineArray->count; ++i)
+    {
+        Line* run = &lineArray->array[i];
+        if (i % LINE_CHECKPOINT_INTERVAL == 0)
+        {
+            LineCheckpoint* checkpoint = &checkpoints[i / LINE_CHECKPOINT_INTERVAL];
+            checkpoint->startByteOffset = start;
+            checkpoint->line = previousLine;
+            checkpoint->position = size;
+        }
+
+        int delta = run->line - previousLine;
+        size += writeVarint(buffer + size, (uint32_t)(run->endingByteOffset + 1 - start));
+        size += writeVarint(buffer + size, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+
+        start = run->endingByteOffset + 1;
+        previousLine = run->line;
+    }
+
+    FREE_ARRAY(Line, lineArray->array, lineArray->capacity);
+    lineArray->array = NULL;
+    lineArray->capacity = 0;
+
+    lineArray->encoded = GROW_ARRAY(uint8_t, buffer, lineArray->count * 10, size);
+    lineArray->encodedCount = size;
+    lineArray->checkpoints = checkpoints;
+    lineArray->checkpointCount = checkpointCount;
+}
+
+static int findRun(LineArray* lineArray, int byteOffset)
 {
-    int lineIndex = 0;
+    int low = 0;
+    int high = lineArray->count - 1;
+
+    while (low < high)
+    {
+        int middle = low + (high - low) / 2;
+        if (lineArray->array[middle].endingByteOffset < byteOffset)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+int getLine(LineArray* lineArray, int byteOffset)
+{
+    if (lineArray->encoded == NULL)
+    {
+        if (lineArray->count == 0) return 0;
+        return lineArray->array[findRun(lineArray, byteOffset)].line;
+    }
+
+    // Last checkpoint starting at or before byteOffset.
+    int low = 0;
+    int high = lineArray->checkpointCount - 1;
+    while (low < high)
+    {
+        int middle = low + (high - low + 1) / 2;
+        if (lineArray->checkpoints[middle].startByteOffset <= byteOffset)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+
+    LineCheckpoint* checkpoint = &lineArray->checkpoints[low];
+    int position = checkpoint->position;
+    int start = checkpoint->startByteOffset;
+    int line = checkpoint->line;
 
-    while (lineIndex < lineArray->count && lineArray->array[lineIndex].endingByteOffset < byteOffset)
+    while (position < lineArray->encodedCount)
     {
-        lineIndex++;
+        uint32_t length = readVarint(lineArray->encoded, &position);
+        uint32_t zigzag = readVarint(lineArray->encoded, &position);
+        line += (int)(zigzag >> 1) ^ -(int)(zigzag & 1);
+        start += (int)length;
+        if (byteOffset < start) break;
     }
 
-   return lineArray->array[lineIndex]; 
+   return line; 
 }
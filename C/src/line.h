@@ -2,24 +2,43 @@
 
 #define clox_line_h
 
+#include "common.h"
+
 typedef struct {
     int line;
     int endingByteOffset;
 } Line;
 
+typedef struct {
+    int startByteOffset;
+    int line;
+    int position;
+} LineCheckpoint;
+
+// While a chunk is being compiled its lines are kept as runs of bytes
+// that share a line. finalizeLineArray() then packs the runs into a
+// stream of varint (run length, zigzag line delta) pairs, with a
+// checkpoint every LINE_CHECKPOINT_INTERVAL runs for binary search.
 typedef struct {
     
     int count;
     int capacity;
     Line* array;
 
+    int encodedCount;
+    uint8_t* encoded;
+    int checkpointCount;
+    LineCheckpoint* checkpoints;
+
 } LineArray;
 
 
 void initLineArray(LineArray* array);
 void freeLineArray(LineArray* array);
 void writeLineArray(LineArray* array, int byteOffset, int line);
-Line getLine(LineArray* lineArray, int byteOffset);
+void truncateLineArray(LineArray* array, int byteCount);
+void finalizeLineArray(LineArray* array);
+int getLine(LineArray* lineArray, int byteOffset);
 
 
 #endif
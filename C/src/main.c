@@ -1,4 +1,5 @@
 #include "common.h"
+#include "batch.h"
 #include "chunk.h"
 #include "vm.h"
 #include "debug.h"
@@ -7,7 +8,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-static void repl()
+static void repl(VM* machine)
 {
     char line[1024];
 
@@ -20,74 +21,111 @@ static void repl()
             printf("\n");
             break;
         }
-        interpret(line);
+        interpret(machine, line);
     }
 }
 
 
-static char* readFile(const char* path)
+static void runFile(VM* machine, char const * path, bool useCache)
 {
-    FILE* file = fopen(path, "rb");
+    Source source;
+    if (!readSource(path, &source)) exit(74);
+    InterpretResult result = interpretFile(machine, path, &source, useCache);
+    freeSource(&source);
 
-    if (file == NULL)
-    {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
-    }
+    if (result == INTERPRET_COMPILE_ERROR) exit(65);
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+}
 
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
 
-    char *source = (char*)malloc(fileSize + 1);
-    if (source == NULL)
+// Reads one path per line.
+static const char** readPaths(int* count)
+{
+    const char** paths = NULL;
+    int capacity = 0;
+    *count = 0;
+
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t length;
+    while ((length = getline(&line, &size, stdin)) > 0)
     {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
+        if (line[length - 1] == '\n') line[--length] = 0;
+        if (length == 0) continue;
+
+        if (capacity < *count + 1)
+        {
+            capacity = capacity < 8 ? 8 : capacity * 2;
+            paths = (const char**)realloc(paths, sizeof(const char*) * capacity);
+            if (paths == NULL) exit(1);
+        }
+        paths[(*count)++] = strdup(line);
     }
-    size_t bytesRead = fread(source, sizeof(char), fileSize, file);
-    if (bytesRead < fileSize)
+    free(line);
+    return paths;
+}
+
+
+static void runBatchFiles(VM* machine, int count, char const * argv[], bool useCache)
+{
+    int failed;
+    if (count > 0)
     {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
-        exit(74);
+        failed = runBatch(machine, argv, count, useCache);
     }
-    source[bytesRead] = 0;
-    
-    if (fclose(file) == EOF)
+    else
     {
-        fprintf(stderr, "Could not close file \"%s\".\n", path);
-        exit(74);
+        const char** paths = readPaths(&count);
+        failed = runBatch(machine, paths, count, useCache);
+        for (int i = 0; i < count; ++i) free((char*)paths[i]);
+        free(paths);
     }
-    return source;
-}
-
-static void runFile(char const * path)
-{
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
-
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    if (failed > 0) exit(1);
 }
 
 
 int main(int argc, char const * argv[])
 {
-    initVM();
+    VM* machine = newVM();
+
+    int arg = 1;
+    bool useCache = true;
+    if (arg < argc && strcmp(argv[arg], "--no-cache") == 0)
+    {
+        useCache = false;
+        arg++;
+    }
+    if (arg < argc && strncmp(argv[arg], "--backend=", 10) == 0)
+    {
+        const char* backend = argv[arg] + 10;
+        if (strcmp(backend, "register") == 0)
+        {
+            machine->backend = BACKEND_REGISTER;
+        }
+        else if (strcmp(backend, "stack") != 0)
+        {
+            fprintf(stderr, "Unknown backend \"%s\".\n", backend);
+            exit(64);
+        }
+        arg++;
+    }
 
-    if (argc == 1) {
-        repl();
+    if (arg < argc && strcmp(argv[arg], "--batch") == 0) {
+        // Without paths, they are read from stdin.
+        runBatchFiles(machine, argc - arg - 1, argv + arg + 1, useCache);
+    }
+    else if (arg == argc) {
+        repl(machine);
     }
-    else if (argc == 2) {
-        runFile(argv[1]);
+    else if (arg == argc - 1) {
+        runFile(machine, argv[arg], useCache);
     }
     else {
-        fprintf(stderr, "Usage: ./clox [path]\n");
+        fprintf(stderr, "Usage: ./clox [--no-cache] [--backend=stack|register] [--batch [path...] | path]\n");
         exit(64);
     }
 
-    freeVM();
+    freeVM(machine);
 
     return 0;
 
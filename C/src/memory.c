@@ -1,17 +1,35 @@
+#include "compiler.h"
 #include "memory.h"
 #include "vm.h"
 
 #include <stdlib.h>
+#include <time.h>
 
+#ifdef DEBUG_LOG_GC
+#include <stdio.h>
+#endif
+
+#define GC_HEAP_GROW_FACTOR 2
 
 void* reallocate(void* pointer, int oldSize, int newSize)
 {
+    vm->bytesAllocated += newSize - oldSize;
+
+    if (newSize > oldSize)
+    {
+#ifdef DEBUG_STRESS_GC
+        collectGarbage();
+#else
+        if (vm->bytesAllocated > vm->nextGC) collectGarbage();
+#endif
+    }
+
     if (newSize == 0)
     {
         free(pointer);
         return NULL;
     }
-    
+
     void *result = realloc(pointer, newSize);
 
     if (result == NULL) exit(1);
@@ -19,18 +37,91 @@ void* reallocate(void* pointer, int oldSize, int newSize)
     return result;
 }
 
+void markObject(Obj* object)
+{
+    if (object == NULL) return;
+    if (object->isMarked) return;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    printValue(stdout, OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    object->isMarked = true;
+
+    if (vm->grayCapacity < vm->grayCount + 1)
+    {
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+        // The gray stack is not part of the managed heap, so it must not
+        // go through reallocate() and retrigger a collection.
+        vm->grayStack = (Obj**)realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
+
+        if (vm->grayStack == NULL) exit(1);
+    }
+
+    vm->grayStack[vm->grayCount++] = object;
+}
+
+void markValue(Value value)
+{
+    if (IS_OBJ(value)) markObject(AS_OBJ(value));
+}
+
+static void markArray(ValueArray* array)
+{
+    for (int i = 0; i < array->count; ++i)
+    {
+        markValue(array->values[i]);
+    }
+}
+
+static void blackenObject(Obj* object)
+{
+#ifdef DEBUG_LOG_GC
+    printf("%p blacken ", (void*)object);
+    printValue(stdout, OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    switch (object->type)
+    {
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            markObject((Obj*)function->name);
+            markArray(&function->chunk.constants);
+            break;
+        }
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            markValue(rope->left);
+            markValue(rope->right);
+            markObject((Obj*)rope->flat);
+            break;
+        }
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+            break;
+    }
+}
+
 static void freeObject(Obj* object)
 {
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*)object, object->type);
+#endif
+
     switch (object->type)
     {
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
-            FREE(ObjString, string);
+            reallocate(string, sizeof(ObjString) + string->length + 1, 0);
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
             freeChunk(&function->chunk);
+            freeRegisterChunk(&function->registerChunk);
             FREE(ObjFunction, function);
             break;
         }
@@ -38,13 +129,109 @@ static void freeObject(Obj* object)
             FREE(ObjNative, object);
             break;
         }
+        case OBJ_ROPE: {
+            FREE(ObjRope, object);
+            break;
+        }
+
+    }
+}
+
+static void markRoots()
+{
+    for (Value* slot = vm->stack; slot < vm->stackTop; ++slot)
+    {
+        markValue(*slot);
+    }
+
+    for (int i = 0; i < vm->frameCount; ++i)
+    {
+        markObject((Obj*)vm->frames[i].function);
+    }
+
+    for (int i = 0; i < vm->moduleCount; ++i)
+    {
+        Module* module = vm->modules[i];
+        markObject((Obj*)module->path);
+        markTable(&module->slots);
+        markArray(&module->values);
+        markArray(&module->names);
+        markObject((Obj*)module->function);
+    }
+    markTable(&vm->modulePaths);
+    markCompilerRoots();
+}
+
+static void traceReferences()
+{
+    while (vm->grayCount > 0)
+    {
+        Obj* object = vm->grayStack[--vm->grayCount];
+        blackenObject(object);
+    }
+}
+
+static void sweep()
+{
+    Obj* previous = NULL;
+    Obj* object = vm->objects;
+
+    while (object != NULL)
+    {
+        if (object->isMarked)
+        {
+            object->isMarked = false;
+            previous = object;
+            object = object->next;
+            continue;
+        }
+
+        Obj* unreached = object;
+        object = object->next;
 
+        if (previous != NULL)
+        {
+            previous->next = object;
+        }
+        else
+        {
+            vm->objects = object;
+        }
+
+        freeObject(unreached);
     }
 }
 
+void collectGarbage()
+{
+    clock_t begin = clock();
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+    size_t before = vm->bytesAllocated;
+#endif
+
+    markRoots();
+    traceReferences();
+    tableRemoveWhite(&vm->strings);
+    sweep();
+
+    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+
+    double pause = (double)(clock() - begin) / CLOCKS_PER_SEC;
+    vm->gcCount++;
+    vm->gcPauseTotal += pause;
+    if (pause > vm->gcPauseMax) vm->gcPauseMax = pause;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+        before - vm->bytesAllocated, before, vm->bytesAllocated, vm->nextGC);
+#endif
+}
+
 void freeObjects()
 {
-    Obj* object = vm.objects;
+    Obj* object = vm->objects;
 
     while (object)
     {
@@ -52,4 +239,6 @@ void freeObjects()
         freeObject(object);
         object = next;
     }
+
+    free(vm->grayStack);
 }
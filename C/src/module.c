@@ -0,0 +1,329 @@
+#include "cache.h"
+#include "compiler.h"
+#include "module.h"
+#include "scanner.h"
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef NO_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#endif
+
+// A module to compile. Jobs are shared with the compiling threads, so they
+// hold plain memory only.
+typedef struct {
+    int module;
+    // From realpath(), or NULL for the REPL.
+    char* path;
+    Source source;
+    size_t length;
+    bool ownsSource;
+    bool useCache;
+
+    // Set by the thread that takes the job. A worker leaves the module in
+    // script; the main thread stores its function right away.
+    CachedScript script;
+    bool hasScript;
+    bool cached;
+    bool failed;
+} Job;
+
+typedef struct {
+    Job* jobs;
+    int count;
+    int capacity;
+#ifndef NO_THREADS
+    // The next job to take.
+    atomic_int next;
+#endif
+} JobList;
+
+static void addJob(JobList* list, int module, char* path, Source* source, bool ownsSource, bool useCache)
+{
+    if (list->capacity < list->count + 1)
+    {
+        list->capacity = list->capacity < 8 ? 8 : list->capacity * 2;
+        list->jobs = (Job*)realloc(list->jobs, sizeof(Job) * list->capacity);
+        if (list->jobs == NULL) exit(1);
+    }
+
+    Job* job = &list->jobs[list->count++];
+    job->module = module;
+    job->path = path;
+    job->source = *source;
+    job->length = strlen(source->chars);
+    job->ownsSource = ownsSource;
+    job->useCache = useCache && source->regular && path != NULL;
+    job->hasScript = false;
+    job->cached = false;
+    job->failed = false;
+}
+
+// Import paths are relative to the directory of the importing script, or
+// to the working directory for the REPL.
+static char* resolvePath(const char* importer, const char* name, int length)
+{
+    size_t directory = 0;
+    if (name[0] != '/' && importer != NULL)
+    {
+        const char* slash = strrchr(importer, '/');
+        if (slash != NULL) directory = (size_t)(slash + 1 - importer);
+    }
+
+    char* joined = (char*)malloc(directory + length + 1);
+    if (joined == NULL) return NULL;
+    memcpy(joined, importer, directory);
+    memcpy(joined + directory, name, length);
+    joined[directory + length] = 0;
+
+    char* resolved = realpath(joined, NULL);
+    free(joined);
+    return resolved;
+}
+
+// Returns the module loaded from path, loading it if it is new. Takes
+// ownership of path.
+static int findModule(JobList* list, char* path, bool useCache)
+{
+    ObjString* key = copyString(path, (int)strlen(path));
+    Value index;
+    if (tableGet(&vm->modulePaths, key, &index))
+    {
+        free(path);
+        return (int)AS_NUMBER(index);
+    }
+
+    Source source;
+    if (!readSource(path, &source))
+    {
+        free(path);
+        return -1;
+    }
+    int module = newModule(key);
+    addJob(list, module, path, &source, true, useCache);
+    return module;
+}
+
+// Imports come before anything else, so only the top of the source is
+// scanned. A malformed import ends the scan and is left to the compiler.
+static bool findImports(JobList* list, int index, bool useCache)
+{
+    Job job = list->jobs[index];
+    Scanner scanner;
+    initScanner(&scanner, job.source.chars, job.source.chars + job.length);
+
+    bool found = true;
+    for (;;)
+    {
+        if (scanToken(&scanner).type != TOKEN_IMPORT) break;
+        Token name = scanToken(&scanner);
+        if (name.type != TOKEN_STRING || scanToken(&scanner).type != TOKEN_SEMICOLON) break;
+
+        char* path = resolvePath(job.path, name.start + 1, name.length - 2);
+        int imported = path == NULL ? -1 : findModule(list, path, useCache);
+        if (imported == -1)
+        {
+            fprintf(stderr, "[line %d] Error at '%.*s': Cannot find module.\n", name.line, name.length, name.start);
+            list->jobs[index].failed = true;
+            found = false;
+            continue;
+        }
+        addImport(job.module, imported);
+    }
+    return found;
+}
+
+static ObjFunction* compileInVM(Job* job)
+{
+    ObjFunction* function = compile(job->source.chars);
+    if (function == NULL || !job->useCache) return function;
+
+    CachedScript script;
+    if (encodeScript(function, job->source.chars, job->length, &script))
+    {
+        writeCachedScript(job->path, &script);
+        freeCachedScript(&script);
+    }
+    return function;
+}
+
+// The main thread works in the running VM, so its modules need no copy.
+static void compileOnMain(Job* job)
+{
+    vm->module = job->module;
+    ObjFunction* function = NULL;
+
+    CachedScript script;
+    if (job->useCache && readCachedScript(job->path, job->source.chars, job->length, &script))
+    {
+        function = decodeScript(&script);
+        freeCachedScript(&script);
+        job->cached = function != NULL;
+    }
+    if (function == NULL) function = compileInVM(job);
+
+    vm->modules[job->module]->function = function;
+    job->failed = function == NULL;
+    vm->module = 0;
+}
+
+#ifndef NO_THREADS
+// Workers compile in a VM of their own, thrown away once the module is
+// encoded, and leave the decoding to the main thread.
+static void compileOnWorker(Job* job)
+{
+    if (job->useCache && readCachedScript(job->path, job->source.chars, job->length, &job->script))
+    {
+        job->hasScript = true;
+        job->cached = true;
+        return;
+    }
+
+    VM* worker = newVM();
+    vm = worker;
+    ObjFunction* function = compile(job->source.chars);
+    if (function != NULL)
+    {
+        job->hasScript = encodeScript(function, job->source.chars, job->length, &job->script);
+        if (job->hasScript && job->useCache) writeCachedScript(job->path, &job->script);
+    }
+    job->failed = !job->hasScript;
+    freeVM(worker);
+}
+
+static void* compileWorker(void* argument)
+{
+    JobList* list = (JobList*)argument;
+    for (int index; (index = atomic_fetch_add(&list->next, 1)) < list->count;)
+    {
+        compileOnWorker(&list->jobs[index]);
+    }
+    return NULL;
+}
+
+static int compileThreads(int jobCount)
+{
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > jobCount) threads = jobCount;
+    if (threads > COMPILE_THREADS_MAX) threads = COMPILE_THREADS_MAX;
+    return threads < 1 ? 1 : (int)threads;
+}
+#endif
+
+static void compileJobs(JobList* list)
+{
+#ifndef NO_THREADS
+    pthread_t threads[COMPILE_THREADS_MAX];
+    bool started[COMPILE_THREADS_MAX] = {false};
+    int threadCount = compileThreads(list->count);
+    for (int i = 1; i < threadCount; ++i)
+    {
+        started[i] = pthread_create(&threads[i], NULL, compileWorker, list) == 0;
+    }
+    for (int index; (index = atomic_fetch_add(&list->next, 1)) < list->count;)
+    {
+        compileOnMain(&list->jobs[index]);
+    }
+    for (int i = 1; i < threadCount; ++i)
+    {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+#else
+    for (int index = 0; index < list->count; ++index) compileOnMain(&list->jobs[index]);
+#endif
+
+    for (int i = 0; i < list->count; ++i)
+    {
+        Job* job = &list->jobs[i];
+        if (!job->hasScript) continue;
+
+        vm->module = job->module;
+        ObjFunction* function = decodeScript(&job->script);
+        vm->module = 0;
+        freeCachedScript(&job->script);
+
+        if (function == NULL)
+        {
+            // Only a cache file that is valid on the outside gets here.
+            job->cached = false;
+            compileOnMain(job);
+            continue;
+        }
+        vm->modules[job->module]->function = function;
+    }
+}
+
+// Dependencies come first. In a cycle, the module reached first runs last.
+static void orderModules(int index, bool* visited, int* order, int* count)
+{
+    if (visited[index]) return;
+    visited[index] = true;
+
+    Module* module = vm->modules[index];
+    for (int i = 0; i < module->importCount; ++i) orderModules(module->imports[i], visited, order, count);
+    if (module->function != NULL) order[(*count)++] = index;
+}
+
+int loadModules(const char* path, Source* source, bool useCache, int** order, bool* cached)
+{
+    JobList list;
+    list.jobs = NULL;
+    list.count = 0;
+    list.capacity = 0;
+#ifndef NO_THREADS
+    list.next = 0;
+#endif
+
+    char* entry = NULL;
+    if (path != NULL)
+    {
+        entry = realpath(path, NULL);
+        if (entry == NULL) entry = strdup(path);
+        if (entry == NULL) exit(1);
+
+        Module* module = vm->modules[0];
+        module->path = copyString(entry, (int)strlen(entry));
+        tableSet(&vm->modulePaths, module->path, NUMBER_VAL(0));
+    }
+    addJob(&list, 0, entry, source, false, useCache);
+
+    // Finding the imports appends new modules, which are scanned in turn.
+    bool succeeded = true;
+    for (int i = 0; i < list.count; ++i)
+    {
+        if (!findImports(&list, i, useCache)) succeeded = false;
+    }
+
+    if (succeeded) compileJobs(&list);
+
+    *cached = true;
+    for (int i = 0; i < list.count; ++i)
+    {
+        Job* job = &list.jobs[i];
+        if (job->failed)
+        {
+            // The errors only give lines.
+            if (i > 0) fprintf(stderr, "Could not compile \"%s\".\n", job->path);
+            succeeded = false;
+        }
+        if (!job->cached) *cached = false;
+        if (job->ownsSource) freeSource(&job->source);
+        free(job->path);
+    }
+    free(list.jobs);
+    if (!succeeded) return -1;
+
+    bool* visited = (bool*)calloc(vm->moduleCount, sizeof(bool));
+    *order = (int*)malloc(sizeof(int) * vm->moduleCount);
+    if (visited == NULL || *order == NULL) exit(1);
+
+    int count = 0;
+    orderModules(0, visited, *order, &count);
+    free(visited);
+    return count;
+}
@@ -0,0 +1,16 @@
+#ifndef clox_module_h
+#define clox_module_h
+
+#include "common.h"
+#include "source.h"
+
+// Compiles source, the script at path or a REPL line when path is NULL,
+// into module zero, along with every module it imports that is not loaded
+// yet. New modules are compiled in parallel, each on a VM of its own, and
+// handed over as cached bytecode. Stores the modules that have not run yet
+// in *order, from malloc(), dependencies first, and returns their count;
+// *cached tells whether none had to be compiled. Returns -1 after
+// reporting an error.
+int loadModules(const char* path, Source* source, bool useCache, int** order, bool* cached);
+
+#endif
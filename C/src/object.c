@@ -7,6 +7,9 @@
 #include <string.h>
 #include <stdio.h>
 
+// Concatenations shorter than this are copied right away.
+#define ROPE_MIN_LENGTH 64
+
 #define ALLOCATE_OBJ_SIZE(type, rawSize, objectType) \
     (type*)allocateObject(rawSize, objectType)
 
@@ -15,32 +18,99 @@
 
 static Obj* allocateObject(size_t size, ObjType type)
 {
-    Obj* object = (Obj*)malloc(size);
+    Obj* object = (Obj*)reallocate(NULL, 0, size);
     object->type = type;
+    object->isMarked = false;
 
-    object->next = vm.objects;
-    vm.objects = object;
+    object->next = vm->objects;
+    vm->objects = object;
     return object;
 }
 
+#define HASH_PRIME_0 0xa0761d6478bd642full
+#define HASH_PRIME_1 0xe7037ed1a0b428dbull
+#define HASH_PRIME_2 0x8ebc6af09c88c6e3ull
+
+// Multiplies to 128 bits and folds the halves together.
+static uint64_t hashMix(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+    uint64_t aLow = (uint32_t)a, aHigh = a >> 32;
+    uint64_t bLow = (uint32_t)b, bHigh = b >> 32;
+    uint64_t low = aLow * bLow, middle0 = aLow * bHigh, middle1 = aHigh * bLow;
+    uint64_t high = aHigh * bHigh + (middle0 >> 32) + (middle1 >> 32);
+    uint64_t carry = (low >> 32) + (uint32_t)middle0 + (uint32_t)middle1;
+    return (low + (middle0 << 32) + (middle1 << 32)) ^ (high + (carry >> 32));
+#endif
+}
+
+static uint64_t read64(const char* chars)
+{
+    uint64_t word;
+    memcpy(&word, chars, sizeof(word));
+    return word;
+}
+
+static uint64_t read32(const char* chars)
+{
+    uint32_t word;
+    memcpy(&word, chars, sizeof(word));
+    return word;
+}
+
+// Reads the string sixteen bytes at a time, and covers the tail with two
+// overlapping words instead of a byte loop. Seeded from vm->hashSeed.
 static uint32_t hashString(const char* chars, int length)
 {
-    uint32_t hash = 2166136261u;
+    uint64_t hash = vm->hashSeed ^ ((uint64_t)length * HASH_PRIME_0);
+    const char* end = chars + length;
 
-    for (int i = 0; i < length; ++i)
+    for (; end - chars > 16; chars += 16)
     {
-        hash ^= chars[i];
-        hash *= 16777619;
+        hash = hashMix(read64(chars) ^ HASH_PRIME_1, read64(chars + 8) ^ hash);
     }
-    return hash;
+
+    int remaining = (int)(end - chars);
+    uint64_t a = 0;
+    uint64_t b = 0;
+    if (remaining >= 8)
+    {
+        a = read64(chars);
+        b = read64(end - 8);
+    }
+    else if (remaining >= 4)
+    {
+        a = read32(chars);
+        b = read32(end - 4);
+    }
+    else if (remaining > 0)
+    {
+        a = (uint64_t)(uint8_t)chars[0] << 16 | (uint64_t)(uint8_t)chars[remaining / 2] << 8 |
+            (uint8_t)chars[remaining - 1];
+    }
+
+    hash = hashMix(a ^ HASH_PRIME_1, b ^ hash);
+    hash = hashMix(hash ^ HASH_PRIME_2, (uint64_t)length ^ HASH_PRIME_1);
+    return (uint32_t)(hash ^ (hash >> 32));
 }
 
-static ObjString* allocateString(int length, uint32_t hash)
+static ObjString* allocateString(int length)
 {
     ObjString* string = ALLOCATE_OBJ_SIZE(ObjString, sizeof(ObjString) + length + 1, OBJ_STRING);
     string->length = length;
-    string->hash = hash;
-    tableSet(&vm.strings, string, NIL_VAL);
+    string->hash = 0;
+    return string;
+}
+
+static ObjString* internString(ObjString* string)
+{
+    // Growing the intern table can trigger a collection.
+    push(OBJ_VAL(string));
+    tableSet(&vm->strings, string, NIL_VAL);
+    pop();
     return string;
 }
 
@@ -51,7 +121,9 @@ ObjFunction* newFunction()
     function->arity = 0;
     function->obj.type = OBJ_FUNCTION;
     function->name = NULL;
+    function->module = vm->module;
     initChunk(&function->chunk);
+    initRegisterChunk(&function->registerChunk);
     return function;
 }
 
@@ -67,57 +139,222 @@ ObjString* copyString(const char* chars, int length)
 {
     uint32_t hash = hashString(chars, length);
 
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
 
     if (interned != NULL) return interned;
 
-    ObjString* string = allocateString(length, hash);
-    memcpy(string->chars, chars, length + 1);
+    ObjString* string = allocateString(length);
+    memcpy(string->chars, chars, length);
     string->chars[length] = 0;
-    return string;
+    string->hash = hash;
+    return internString(string);
 }
 
-ObjString* concatenateStrings(const ObjString* a, const ObjString* b)
+// Interns string, whose characters are already filled in, unless an
+// equal string is interned already.
+static ObjString* internFresh(ObjString* string)
 {
-    ObjString* string = allocateString(a->length + b->length, -1);
-    memcpy(string->chars, a->chars, a->length);
-    memcpy(string->chars + a->length, b->chars, b->length + 1);
-
-    int hash = hashString(string->chars, string->length);
+    uint32_t hash = hashString(string->chars, string->length);
 
-    ObjString* interned = tableFindString(&vm.strings, string->chars, string->length, hash);
+    ObjString* interned = tableFindString(&vm->strings, string->chars, string->length, hash);
 
+    // The fresh copy is left unreachable and reclaimed by the next collection.
     if (interned != NULL) return interned;
 
     string->hash = hash;
 
-    return string;
+    return internString(string);
+}
+
+Value copyStringValue(const char* chars, int length)
+{
+    // A zero byte would read as the end of a small string.
+    if (length <= SMALL_STRING_MAX && memchr(chars, 0, length) == NULL)
+    {
+        return smallStringValue(chars, length);
+    }
+    return OBJ_VAL(copyString(chars, length));
 }
 
-void printFunction(ObjFunction* function)
+static int textLength(Value text)
+{
+    if (IS_SMALL_STRING(text)) return smallStringLength(text);
+    return IS_ROPE(text) ? AS_ROPE(text)->length : AS_STRING(text)->length;
+}
+
+// A rope that was flattened already stands for its flat string.
+static Value ropeSide(Value text)
+{
+    if (IS_ROPE(text) && AS_ROPE(text)->flat != NULL) return OBJ_VAL(AS_ROPE(text)->flat);
+    return text;
+}
+
+// Walks the tree with an explicit stack, since a rope built in a loop is
+// as deep as the loop is long.
+static void copyRopeChars(ObjRope* rope, char* chars)
+{
+    int capacity = 64;
+    int count = 0;
+    Value* pending = (Value*)malloc(sizeof(Value) * capacity);
+    if (pending == NULL) exit(1);
+
+    pending[count++] = OBJ_VAL(rope);
+    while (count > 0)
+    {
+        Value text = ropeSide(pending[--count]);
+        if (IS_SMALL_STRING(text))
+        {
+            chars += smallStringChars(text, chars);
+            continue;
+        }
+        if (IS_STRING(text))
+        {
+            ObjString* string = AS_STRING(text);
+            memcpy(chars, string->chars, string->length);
+            chars += string->length;
+            continue;
+        }
+
+        if (count + 2 > capacity)
+        {
+            capacity *= 2;
+            pending = (Value*)realloc(pending, sizeof(Value) * capacity);
+            if (pending == NULL) exit(1);
+        }
+        pending[count++] = AS_ROPE(text)->right;
+        pending[count++] = AS_ROPE(text)->left;
+    }
+
+    free(pending);
+}
+
+static void copyTextChars(Value text, char* chars)
+{
+    if (IS_SMALL_STRING(text))
+    {
+        smallStringChars(text, chars);
+    }
+    else if (IS_ROPE(text))
+    {
+        copyRopeChars(AS_ROPE(text), chars);
+    }
+    else
+    {
+        memcpy(chars, AS_STRING(text)->chars, AS_STRING(text)->length);
+    }
+}
+
+Value concatenateValues(Value a, Value b)
+{
+    a = ropeSide(a);
+    b = ropeSide(b);
+
+    int aLength = textLength(a);
+    int bLength = textLength(b);
+    if (aLength == 0) return b;
+    if (bLength == 0) return a;
+
+    int length = aLength + bLength;
+    if (length <= SMALL_STRING_MAX && IS_SMALL_STRING(a) && IS_SMALL_STRING(b))
+    {
+        return SMALL_STRING_VAL(AS_SMALL_STRING(a) | AS_SMALL_STRING(b) << (8 * aLength));
+    }
+
+    // Short results are cheaper to copy than to defer.
+    if (length < ROPE_MIN_LENGTH)
+    {
+        ObjString* string = allocateString(length);
+        copyTextChars(a, string->chars);
+        copyTextChars(b, string->chars + aLength);
+        string->chars[length] = 0;
+        return OBJ_VAL(internFresh(string));
+    }
+
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = length;
+    rope->left = a;
+    rope->right = b;
+    rope->flat = NULL;
+    return OBJ_VAL(rope);
+}
+
+ObjString* flattenRope(ObjRope* rope)
+{
+    if (rope->flat != NULL) return rope->flat;
+
+    // Allocating can trigger a collection, which must not take the rope.
+    push(OBJ_VAL(rope));
+    ObjString* string = allocateString(rope->length);
+    copyRopeChars(rope, string->chars);
+    string->chars[rope->length] = 0;
+
+    rope->flat = internFresh(string);
+    rope->left = NIL_VAL;
+    rope->right = NIL_VAL;
+    pop();
+    return rope->flat;
+}
+
+bool ropesEqual(Value a, Value b)
+{
+    if (!IS_ANY_STRING(a) || !IS_ANY_STRING(b)) return false;
+    // Small strings are never as long as a rope.
+    if (textLength(a) != textLength(b)) return false;
+
+    // Interned strings are equal exactly when they are the same object, so
+    // compare the flattened strings. a stays reachable while b flattens.
+    push(a);
+    push(b);
+    ObjString* aString = IS_ROPE(a) ? flattenRope(AS_ROPE(a)) : AS_STRING(a);
+    ObjString* bString = IS_ROPE(b) ? flattenRope(AS_ROPE(b)) : AS_STRING(b);
+    pop();
+    pop();
+    return aString == bString;
+}
+
+static void printRope(FILE* file, ObjRope* rope)
+{
+    if (rope->flat != NULL)
+    {
+        fprintf(file, "%s", rope->flat->chars);
+        return;
+    }
+
+    // Printing leaves the rope as it is, so it never allocates on the heap.
+    char* chars = (char*)malloc(rope->length);
+    if (chars == NULL) exit(1);
+    copyRopeChars(rope, chars);
+    fwrite(chars, 1, rope->length, file);
+    free(chars);
+}
+
+void printFunction(FILE* file, ObjFunction* function)
 {
     if (function->name == NULL)
     {
-        printf("<script>");
+        fprintf(file, "<script>");
     }
     else
     {
-        printf("<fn %s>", function->name->chars);
+        fprintf(file, "<fn %s>", function->name->chars);
     }
 }
 
-void printObject(Obj* object)
+void printObject(FILE* file, Obj* object)
 {
     switch (object->type)
     {
         case OBJ_STRING:
-            printf("%s", ((ObjString*)object)->chars);
+            fprintf(file, "%s", ((ObjString*)object)->chars);
             break;
         case OBJ_FUNCTION:
-            printFunction((ObjFunction*)object);
+            printFunction(file, (ObjFunction*)object);
             break;
         case OBJ_NATIVE:
-            printf("<native fn>");
+            fprintf(file, "<native fn>");
+            break;
+        case OBJ_ROPE:
+            printRope(file, (ObjRope*)object);
             break;
     }
 }
@@ -142,5 +379,7 @@ bool objsEqual(Obj* a, Obj* b)
             ObjNative* bNative = (ObjNative*)b;
             return  aNative->function == bNative->function;
         }
+        case OBJ_ROPE:
+            return ropesEqual(OBJ_VAL(a), OBJ_VAL(b));
     }   
 }
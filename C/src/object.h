@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "chunk.h"
+#include "registers.h"
 #include "value.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
@@ -10,28 +11,37 @@
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (AS_STRING(value)->chars)
 #define AS_NATIVE(value) (((ObjNative*)(AS_OBJ(value)))->function)
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
 
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+// Small strings and ropes are strings as far as scripts can tell.
+#define IS_ANY_STRING(value) (IS_SMALL_STRING(value) || IS_STRING(value) || IS_ROPE(value))
 
 typedef enum {
     OBJ_FUNCTION,
     OBJ_NATIVE,
     OBJ_STRING,
+    OBJ_ROPE,
 } ObjType;
 
 struct sObj {
     ObjType type;
+    bool isMarked;
     struct sObj* next;
 };
 
-typedef struct {
+struct sObjFunction {
     Obj obj;
     int arity;
     Chunk chunk;
+    RegisterChunk registerChunk;
     ObjString* name;
-} ObjFunction;
+    // The module whose globals the code refers to.
+    int module;
+};
 
 typedef Value (*NativeFn)(int argCount, Value* args);
 
@@ -48,12 +58,28 @@ struct sObjString {
     char chars[];
 };
 
+// A concatenation whose characters are only copied out, and interned,
+// when something needs them as one string. Each side is any string value,
+// including another rope. Once flattened the sides are dropped for flat.
+typedef struct {
+    Obj obj;
+    int length;
+    Value left;
+    Value right;
+    ObjString* flat;
+} ObjRope;
+
 
 ObjFunction* newFunction();
 ObjNative* newNative(NativeFn function, int arity);
 ObjString* copyString(const char* start, int length);
-ObjString* concatenateStrings(const ObjString* a, const ObjString* b);
-void printObject(Obj* object);
+// A string value: small when it fits, an interned ObjString otherwise.
+Value copyStringValue(const char* start, int length);
+// a and b are string values, and must stay reachable meanwhile.
+Value concatenateValues(Value a, Value b);
+ObjString* flattenRope(ObjRope* rope);
+bool ropesEqual(Value a, Value b);
+void printObject(FILE* file, Obj* object);
 
 
 static inline bool isObjType(Value value, ObjType type)
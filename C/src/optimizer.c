@@ -0,0 +1,281 @@
+#include "memory.h"
+#include "optimizer.h"
+
+#include <stdlib.h>
+
+#define MAX_THREADING 16
+
+typedef struct {
+    int start;
+    int length;
+    int target;
+    int newStart;
+    uint8_t opcode;
+    uint8_t popCount;
+    bool reachable;
+    bool isTarget;
+    bool removed;
+} Instruction;
+
+static bool isConditionalJump(uint8_t opcode)
+{
+    switch (opcode)
+    {
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_OR_POP:
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+        case OP_LESS_LOCAL_CONSTANT_JUMP_OR_POP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool isUnconditionalJump(uint8_t opcode)
+{
+    return opcode == OP_JUMP || opcode == OP_LOOP;
+}
+
+static bool isTerminator(uint8_t opcode)
+{
+    return isUnconditionalJump(opcode) || opcode == OP_RETURN;
+}
+
+// Follows chains of jumps that are known to be taken again once landed
+// on: unconditional jumps always, and conditional ones when the falsy
+// value left by a conditional jump is tested again.
+static int threadJump(Instruction* instructions, int* indexAt, Instruction* jump)
+{
+    int target = jump->target;
+    bool conditional = isConditionalJump(jump->opcode);
+
+    for (int i = 0; i < MAX_THREADING; ++i)
+    {
+        Instruction* next = &instructions[indexAt[target]];
+        int nextTarget;
+
+        if (isUnconditionalJump(next->opcode))
+        {
+            nextTarget = next->target;
+        }
+        else if (conditional && (next->opcode == OP_JUMP_IF_FALSE || next->opcode == OP_JUMP_IF_FALSE_OR_POP))
+        {
+            nextTarget = next->target;
+        }
+        else
+        {
+            break;
+        }
+
+        // Only unconditional jumps can turn into loops. The others
+        // encode forward offsets.
+        if (!isUnconditionalJump(jump->opcode) && nextTarget <= jump->start) break;
+        if (nextTarget == target) break;
+        target = nextTarget;
+    }
+    return target;
+}
+
+static void markReachable(Instruction* instructions, int count, int* indexAt)
+{
+    int* worklist = ALLOCATE(int, count);
+    int size = 0;
+
+    instructions[0].reachable = true;
+    worklist[size++] = 0;
+
+    while (size > 0)
+    {
+        Instruction* instruction = &instructions[worklist[--size]];
+        int successors[2];
+        int successorCount = 0;
+
+        int next = (int)(instruction - instructions) + 1;
+        if (!isTerminator(instruction->opcode) && next < count) successors[successorCount++] = next;
+        if (instruction->target != -1) successors[successorCount++] = indexAt[instruction->target];
+
+        for (int i = 0; i < successorCount; ++i)
+        {
+            if (instructions[successors[i]].reachable) continue;
+            instructions[successors[i]].reachable = true;
+            worklist[size++] = successors[i];
+        }
+    }
+
+    FREE_ARRAY(int, worklist, count);
+}
+
+static void combineInstructions(Instruction* instructions, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        Instruction* instruction = &instructions[i];
+        if (instruction->removed) continue;
+
+        if (instruction->opcode == OP_EQUAL && i + 1 < count &&
+            instructions[i + 1].opcode == OP_NOT && !instructions[i + 1].isTarget)
+        {
+            instruction->opcode = OP_NOT_EQUAL;
+            instructions[i + 1].removed = true;
+        }
+        else if (instruction->opcode == OP_POP)
+        {
+            int run = i + 1;
+            while (run < count && !instructions[run].removed && instructions[run].opcode == OP_POP &&
+                !instructions[run].isTarget && instruction->popCount < UINT8_MAX)
+            {
+                instruction->popCount++;
+                instructions[run].removed = true;
+                run++;
+            }
+            if (instruction->popCount > 1)
+            {
+                instruction->opcode = OP_POPN;
+                instruction->length = 2;
+            }
+        }
+    }
+
+    // A forward jump over nothing but removed code is a no-op.
+    for (int i = 0; i < count; ++i)
+    {
+        Instruction* instruction = &instructions[i];
+        if (instruction->removed || instruction->opcode != OP_JUMP) continue;
+
+        int next = i + 1;
+        while (next < count && instructions[next].removed) next++;
+        if (next < count && instructions[next].start == instruction->target) instruction->removed = true;
+        if (next == count && instruction->target == instructions[count - 1].start + instructions[count - 1].length)
+        {
+            instruction->removed = true;
+        }
+    }
+}
+
+void optimizeChunk(Chunk* chunk)
+{
+    if (chunk->count == 0) return;
+
+    int* indexAt = ALLOCATE(int, chunk->count + 1);
+    Instruction* instructions = ALLOCATE(Instruction, chunk->count);
+    int count = 0;
+
+    for (int offset = 0; offset < chunk->count;)
+    {
+        Instruction* instruction = &instructions[count];
+        uint8_t opcode = chunk->code[offset];
+
+        instruction->start = offset;
+        instruction->length = instructionLength(opcode);
+        instruction->opcode = opcode;
+        instruction->popCount = 1;
+        instruction->reachable = false;
+        instruction->isTarget = false;
+        instruction->removed = false;
+        instruction->target = jumpTarget(chunk, offset);
+
+        for (int i = 0; i < instruction->length; ++i) indexAt[offset + i] = count;
+        offset += instruction->length;
+        count++;
+    }
+    // Jumps may land just past the last instruction.
+    indexAt[chunk->count] = count;
+
+    bool valid = true;
+    for (int i = 0; i < count; ++i)
+    {
+        Instruction* instruction = &instructions[i];
+        if (instruction->target == -1) continue;
+        if (instruction->target < 0 || instruction->target >= chunk->count ||
+            instructions[indexAt[instruction->target]].start != instruction->target)
+        {
+            valid = false;
+        }
+    }
+
+    if (valid)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            if (instructions[i].target != -1)
+            {
+                instructions[i].target = threadJump(instructions, indexAt, &instructions[i]);
+            }
+        }
+
+        markReachable(instructions, count, indexAt);
+
+        for (int i = 0; i < count; ++i)
+        {
+            if (!instructions[i].reachable) instructions[i].removed = true;
+            else if (instructions[i].target != -1) instructions[indexAt[instructions[i].target]].isTarget = true;
+        }
+
+        combineInstructions(instructions, count);
+
+        // Removed instructions resolve to whatever follows them.
+        int newCount = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            instructions[i].newStart = newCount;
+            if (!instructions[i].removed) newCount += instructions[i].length;
+        }
+
+        uint8_t* code = ALLOCATE(uint8_t, newCount);
+        LineArray lines;
+        initLineArray(&lines);
+
+        for (int i = 0; i < count && valid; ++i)
+        {
+            Instruction* instruction = &instructions[i];
+            if (instruction->removed) continue;
+
+            uint8_t* out = &code[instruction->newStart];
+            for (int j = 0; j < instruction->length; ++j) out[j] = chunk->code[instruction->start + j];
+            out[0] = instruction->opcode;
+
+            if (instruction->opcode == OP_POPN) out[1] = instruction->popCount;
+
+            if (instruction->target != -1)
+            {
+                int end = instruction->newStart + instruction->length;
+                int target = instructions[indexAt[instruction->target]].newStart;
+                int jump = target - end;
+
+                if (isUnconditionalJump(instruction->opcode))
+                {
+                    out[0] = jump < 0 ? OP_LOOP : OP_JUMP;
+                    if (jump < 0) jump = -jump;
+                }
+                if (jump < 0 || jump > UINT16_MAX)
+                {
+                    valid = false;
+                    break;
+                }
+                out[instruction->length - 2] = (jump >> 8) & 0xff;
+                out[instruction->length - 1] = jump & 0xff;
+            }
+
+            int line = getLine(&chunk->lines, instruction->start);
+            for (int j = 0; j < instruction->length; ++j) writeLineArray(&lines, instruction->newStart + j, line);
+        }
+
+        if (valid)
+        {
+            FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+            freeLineArray(&chunk->lines);
+            chunk->code = code;
+            chunk->count = newCount;
+            chunk->capacity = newCount;
+            chunk->lines = lines;
+        }
+        else
+        {
+            FREE_ARRAY(uint8_t, code, newCount);
+            freeLineArray(&lines);
+        }
+    }
+
+    FREE_ARRAY(Instruction, instructions, chunk->count);
+    FREE_ARRAY(int, indexAt, chunk->count + 1);
+}
@@ -0,0 +1,659 @@
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "registers.h"
+
+#ifdef DEBUG_PRINT_CODE
+#include "debug.h"
+#endif
+
+#include <stdio.h>
+
+// The translator replays the stack bytecode against a symbolic stack.
+// Stack slot i always lives in register i, but values are only written
+// there when something needs them in place: a pushed constant or a copy
+// of a local stays pending until an instruction consumes it, which then
+// reads the constant or the local's register directly. Everything is
+// written back before jumps and at jump targets, so control flow always
+// meets the plain slot = register layout.
+typedef enum {
+    OPERAND_REGISTER,
+    OPERAND_LOCAL,
+    OPERAND_CONSTANT,
+} OperandType;
+
+typedef struct {
+    OperandType type;
+    int index;
+} Operand;
+
+typedef struct {
+    int stackOffset;
+    int word;
+} JumpPatch;
+
+typedef struct {
+    Chunk* source;
+    RegisterChunk* chunk;
+    int line;
+
+    Operand stack[REGISTERS_MAX];
+    int depth;
+
+    // Register code offset of each stack instruction, and the stack depth
+    // expected at each jump target.
+    int* wordAt;
+    int* depthAt;
+    bool* isTarget;
+
+    JumpPatch* patches;
+    int patchCount;
+    int patchCapacity;
+
+    // Start of the last emitted instruction, and the start of the code
+    // after the most recent jump target. Fusing with the previous
+    // instruction is only safe when no jump lands in between.
+    int lastInstruction;
+    int blockStart;
+
+    bool hadError;
+} Translator;
+
+static const uint8_t registerFormats[] = {
+#define REGISTER_OPCODE_FORMAT(name, format) format,
+    REGISTER_OPCODE_LIST(REGISTER_OPCODE_FORMAT)
+#undef REGISTER_OPCODE_FORMAT
+};
+
+void initRegisterChunk(RegisterChunk* chunk)
+{
+    chunk->count = 0;
+    chunk->capacity = 0;
+    chunk->code = NULL;
+    chunk->registerCount = 0;
+    initLineArray(&chunk->lines);
+}
+
+void freeRegisterChunk(RegisterChunk* chunk)
+{
+    FREE_ARRAY(RegisterInstruction, chunk->code, chunk->capacity);
+    freeLineArray(&chunk->lines);
+    initRegisterChunk(chunk);
+}
+
+RegisterFormat registerFormat(uint8_t instruction)
+{
+    return (RegisterFormat)registerFormats[instruction];
+}
+
+int registerInstructionLength(uint8_t instruction)
+{
+    switch (registerFormat(instruction))
+    {
+        case FORMAT_AK_LONG:
+        case FORMAT_AG_LONG:
+        case FORMAT_GLOBAL_LONG:
+        case FORMAT_JUMP:
+        case FORMAT_TEST:
+        case FORMAT_COMPARE_JUMP:
+        case FORMAT_COMPARE_K_JUMP:
+        case FORMAT_INLINE_CALL:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+static bool writesA(uint8_t instruction)
+{
+    switch (registerFormat(instruction))
+    {
+        case FORMAT_A:
+        case FORMAT_AB:
+        case FORMAT_ABC:
+        case FORMAT_ABK:
+        case FORMAT_AK:
+        case FORMAT_AK_LONG:
+        case FORMAT_AG:
+        case FORMAT_AG_LONG:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void emitWord(Translator* translator, RegisterInstruction word)
+{
+    RegisterChunk* chunk = translator->chunk;
+    if (chunk->capacity < chunk->count + 1)
+    {
+        int oldCapacity = chunk->capacity;
+        chunk->capacity = GROW_CAPACITY(oldCapacity);
+        chunk->code = GROW_ARRAY(RegisterInstruction, chunk->code, oldCapacity, chunk->capacity);
+    }
+    chunk->code[chunk->count] = word;
+    writeLineArray(&chunk->lines, chunk->count, translator->line);
+    chunk->count++;
+}
+
+static void emit(Translator* translator, RegisterInstruction instruction)
+{
+    translator->lastInstruction = translator->chunk->count;
+    emitWord(translator, instruction);
+}
+
+static void emitJump(Translator* translator, RegisterInstruction instruction, int stackTarget)
+{
+    emit(translator, instruction);
+
+    if (translator->patchCapacity < translator->patchCount + 1)
+    {
+        int oldCapacity = translator->patchCapacity;
+        translator->patchCapacity = GROW_CAPACITY(oldCapacity);
+        translator->patches = GROW_ARRAY(JumpPatch, translator->patches, oldCapacity, translator->patchCapacity);
+    }
+    translator->patches[translator->patchCount].stackOffset = stackTarget;
+    translator->patches[translator->patchCount].word = translator->chunk->count;
+    translator->patchCount++;
+    emitWord(translator, 0);
+}
+
+// The previous instruction, if it can still be rewritten in place.
+static RegisterInstruction* previousInstruction(Translator* translator)
+{
+    if (translator->lastInstruction < translator->blockStart) return NULL;
+    return &translator->chunk->code[translator->lastInstruction];
+}
+
+static void pushOperand(Translator* translator, OperandType type, int index)
+{
+    if (translator->depth == REGISTERS_MAX)
+    {
+        translator->hadError = true;
+        return;
+    }
+    translator->stack[translator->depth].type = type;
+    translator->stack[translator->depth].index = index;
+    translator->depth++;
+}
+
+static Operand* peekOperand(Translator* translator, int distance)
+{
+    return &translator->stack[translator->depth - 1 - distance];
+}
+
+static void emitLoadConstant(Translator* translator, int target, int constant)
+{
+    if (constant <= UINT16_MAX)
+    {
+        emit(translator, REGISTER_ABX(ROP_LOADK, target, constant));
+        return;
+    }
+    emit(translator, REGISTER_ABC(ROP_LOADK_LONG, target, 0, 0));
+    emitWord(translator, (RegisterInstruction)constant);
+}
+
+static void materialize(Translator* translator, int slot)
+{
+    Operand* operand = &translator->stack[slot];
+
+    switch (operand->type)
+    {
+        case OPERAND_REGISTER:
+            return;
+        case OPERAND_LOCAL:
+            emit(translator, REGISTER_ABC(ROP_MOVE, slot, operand->index, 0));
+            break;
+        case OPERAND_CONSTANT:
+            emitLoadConstant(translator, slot, operand->index);
+            break;
+    }
+    operand->type = OPERAND_REGISTER;
+    operand->index = slot;
+}
+
+static void materializeAll(Translator* translator)
+{
+    for (int slot = 0; slot < translator->depth; ++slot) materialize(translator, slot);
+}
+
+// Before a local's register is overwritten, pending copies of its old
+// value must be written out.
+static void materializeCopies(Translator* translator, int local)
+{
+    for (int slot = 0; slot < translator->depth; ++slot)
+    {
+        Operand* operand = &translator->stack[slot];
+        if (operand->type == OPERAND_LOCAL && operand->index == local) materialize(translator, slot);
+    }
+}
+
+// Register holding the value of a stack slot, writing it out if needed.
+static int readRegister(Translator* translator, int slot)
+{
+    Operand* operand = &translator->stack[slot];
+    if (operand->type == OPERAND_CONSTANT) materialize(translator, slot);
+    return operand->type == OPERAND_LOCAL ? operand->index : slot;
+}
+
+static int localRegister(Translator* translator, int slot)
+{
+    materialize(translator, slot);
+    return slot;
+}
+
+static void writeLocal(Translator* translator, int local)
+{
+    materializeCopies(translator, local);
+    Operand* value = peekOperand(translator, 0);
+    int top = translator->depth - 1;
+
+    translator->stack[local].type = OPERAND_REGISTER;
+    translator->stack[local].index = local;
+
+    RegisterInstruction* previous = previousInstruction(translator);
+    if (value->type == OPERAND_REGISTER && previous != NULL &&
+        writesA(REGISTER_OP(*previous)) && REGISTER_A(*previous) == (uint32_t)top)
+    {
+        // Retarget the instruction that computed the value.
+        *previous = (*previous & ~(RegisterInstruction)0xff00) | (RegisterInstruction)local << 8;
+        value->type = OPERAND_LOCAL;
+        value->index = local;
+        return;
+    }
+
+    switch (value->type)
+    {
+        case OPERAND_CONSTANT:
+            emitLoadConstant(translator, local, value->index);
+            break;
+        case OPERAND_REGISTER:
+            emit(translator, REGISTER_ABC(ROP_MOVE, local, top, 0));
+            break;
+        case OPERAND_LOCAL:
+            if (value->index != local) emit(translator, REGISTER_ABC(ROP_MOVE, local, value->index, 0));
+            break;
+    }
+    value->type = OPERAND_LOCAL;
+    value->index = local;
+}
+
+static void binary(Translator* translator, uint8_t registerOp, uint8_t constantOp)
+{
+    int a = translator->depth - 2;
+    Operand* right = peekOperand(translator, 0);
+    int left = readRegister(translator, a);
+
+    if (right->type == OPERAND_CONSTANT && right->index <= UINT8_MAX)
+    {
+        emit(translator, REGISTER_ABC(constantOp, a, left, right->index));
+    }
+    else
+    {
+        int b = readRegister(translator, a + 1);
+        emit(translator, REGISTER_ABC(registerOp, a, left, b));
+    }
+    translator->depth--;
+    translator->stack[a].type = OPERAND_REGISTER;
+    translator->stack[a].index = a;
+}
+
+static void unary(Translator* translator, uint8_t op)
+{
+    int a = translator->depth - 1;
+    int b = readRegister(translator, a);
+    emit(translator, REGISTER_ABC(op, a, b, 0));
+    translator->stack[a].type = OPERAND_REGISTER;
+    translator->stack[a].index = a;
+}
+
+static bool isPop(Chunk* chunk, int offset)
+{
+    return offset < chunk->count && (chunk->code[offset] == OP_POP || chunk->code[offset] == OP_POPN);
+}
+
+static void recordTarget(Translator* translator, int target, int depth)
+{
+    translator->depthAt[target] = depth;
+}
+
+// Turns "R[A] = R[B] < x; jump if R[A] is false" into a single compare
+// and branch, when nothing reads the boolean afterwards.
+static bool fuseCompareJump(Translator* translator, int stackTarget)
+{
+    RegisterInstruction* previous = previousInstruction(translator);
+    if (previous == NULL || REGISTER_A(*previous) != (uint32_t)(translator->depth - 1)) return false;
+
+    uint8_t op;
+    switch (REGISTER_OP(*previous))
+    {
+        case ROP_LESS:     op = ROP_JUMP_IF_NOT_LESS; break;
+        case ROP_LESSK:    op = ROP_JUMP_IF_NOT_LESSK; break;
+        case ROP_GREATER:  op = ROP_JUMP_IF_NOT_GREATER; break;
+        case ROP_GREATERK: op = ROP_JUMP_IF_NOT_GREATERK; break;
+        default:
+            return false;
+    }
+
+    RegisterInstruction compare = *previous;
+    translator->chunk->count = translator->lastInstruction;
+    truncateLineArray(&translator->chunk->lines, translator->chunk->count);
+    emitJump(translator, REGISTER_ABC(op, 0, REGISTER_B(compare), REGISTER_C(compare)), stackTarget);
+    return true;
+}
+
+// Emits a global access, moving the slot to an extra word when it does
+// not fit in Bx.
+static void emitGlobal(Translator* translator, uint8_t op, uint8_t longOp, int target, uint8_t* code)
+{
+    bool isLong = code[0] == OP_GET_GLOBAL_LONG || code[0] == OP_SET_GLOBAL_LONG || code[0] == OP_DEFINE_GLOBAL_LONG;
+    int slot = isLong ? readLongOperand(&code[1]) : code[1];
+
+    if (slot <= UINT16_MAX)
+    {
+        emit(translator, REGISTER_ABX(op, target, slot));
+        return;
+    }
+    emit(translator, REGISTER_ABC(longOp, target, 0, 0));
+    emitWord(translator, (RegisterInstruction)slot);
+}
+
+static void translateInstruction(Translator* translator, int offset)
+{
+    Chunk* source = translator->source;
+    uint8_t* code = &source->code[offset];
+    int length = instructionLength(code[0]);
+    int top = translator->depth - 1;
+
+    switch (code[0])
+    {
+        case OP_CONSTANT: pushOperand(translator, OPERAND_CONSTANT, code[1]); break;
+        case OP_CONSTANT_LONG: pushOperand(translator, OPERAND_CONSTANT, readLongOperand(&code[1])); break;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE: {
+            uint8_t op = code[0] == OP_NIL ? ROP_NIL : code[0] == OP_TRUE ? ROP_TRUE : ROP_FALSE;
+            emit(translator, REGISTER_ABC(op, translator->depth, 0, 0));
+            pushOperand(translator, OPERAND_REGISTER, translator->depth);
+            break;
+        }
+        case OP_EQUAL:     binary(translator, ROP_EQUAL, ROP_EQUALK); break;
+        case OP_NOT_EQUAL: binary(translator, ROP_NOT_EQUAL, ROP_NOT_EQUALK); break;
+        case OP_GREATER:   binary(translator, ROP_GREATER, ROP_GREATERK); break;
+        case OP_LESS:      binary(translator, ROP_LESS, ROP_LESSK); break;
+        case OP_ADD:       binary(translator, ROP_ADD, ROP_ADDK); break;
+        case OP_SUBSTRACT: binary(translator, ROP_SUBSTRACT, ROP_SUBSTRACTK); break;
+        case OP_MULTIPLY:  binary(translator, ROP_MULTIPLY, ROP_MULTIPLYK); break;
+        case OP_DIVIDE:    binary(translator, ROP_DIVIDE, ROP_DIVIDEK); break;
+        case OP_NEGATE:    unary(translator, ROP_NEGATE); break;
+        case OP_NOT:       unary(translator, ROP_NOT); break;
+        case OP_PRINT:
+            emit(translator, REGISTER_ABC(ROP_PRINT, readRegister(translator, top), 0, 0));
+            translator->depth--;
+            break;
+        case OP_POP:  translator->depth--; break;
+        case OP_POPN: translator->depth -= code[1]; break;
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+            emitGlobal(translator, ROP_DEFINE_GLOBAL, ROP_DEFINE_GLOBAL_LONG, readRegister(translator, top), code);
+            translator->depth--;
+            break;
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+            emitGlobal(translator, ROP_SET_GLOBAL, ROP_SET_GLOBAL_LONG, readRegister(translator, top), code);
+            break;
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+            emitGlobal(translator, ROP_GET_GLOBAL, ROP_GET_GLOBAL_LONG, translator->depth, code);
+            pushOperand(translator, OPERAND_REGISTER, translator->depth);
+            break;
+        case OP_GET_LOCAL: {
+            Operand local = translator->stack[code[1]];
+            if (local.type == OPERAND_REGISTER) local.type = OPERAND_LOCAL;
+            pushOperand(translator, local.type, local.index);
+            break;
+        }
+        case OP_SET_LOCAL:
+            writeLocal(translator, code[1]);
+            break;
+        case OP_SET_LOCAL_POP:
+            writeLocal(translator, code[1]);
+            translator->depth--;
+            break;
+        case OP_JUMP:
+        case OP_LOOP: {
+            int target = jumpTarget(source, offset);
+            materializeAll(translator);
+            recordTarget(translator, target, translator->depth);
+            emitJump(translator, REGISTER_ABC(ROP_JUMP, 0, 0, 0), target);
+            break;
+        }
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_OR_POP: {
+            int target = jumpTarget(source, offset);
+            bool popsOnFallthrough = code[0] == OP_JUMP_IF_FALSE_OR_POP || isPop(source, offset + length);
+
+            materializeAll(translator);
+            recordTarget(translator, target, translator->depth);
+            if (!popsOnFallthrough || !isPop(source, target) || !fuseCompareJump(translator, target))
+            {
+                emitJump(translator, REGISTER_ABC(ROP_JUMP_IF_FALSE, top, 0, 0), target);
+            }
+            if (code[0] == OP_JUMP_IF_FALSE_OR_POP) translator->depth--;
+            break;
+        }
+        case OP_CALL:
+        case OP_CALL_0:
+        case OP_CALL_1:
+        case OP_CALL_2:
+        case OP_CALL_3:
+        case OP_TAIL_CALL: {
+            int argCount = code[0] == OP_CALL || code[0] == OP_TAIL_CALL ? code[1] : code[0] - OP_CALL_0;
+            int base = translator->depth - argCount - 1;
+            for (int slot = base; slot < translator->depth; ++slot) materialize(translator, slot);
+            uint8_t op = code[0] == OP_TAIL_CALL ? ROP_TAIL_CALL : ROP_CALL;
+            emit(translator, REGISTER_ABC(op, base, argCount, 0));
+            translator->depth = base + 1;
+            break;
+        }
+        case OP_INLINE_CALL: {
+            // The body starts at the target, with the arguments moved down
+            // over the callee. A call for any other callee follows.
+            int target = jumpTarget(source, offset);
+            materializeAll(translator);
+            recordTarget(translator, target, translator->depth - 1);
+            emitJump(translator, REGISTER_ABC(ROP_INLINE_CALL, top - code[1], code[1], code[2]), target);
+            break;
+        }
+        case OP_PEEK: {
+            Operand value = translator->stack[top - code[1]];
+            if (value.type == OPERAND_REGISTER) value.type = OPERAND_LOCAL;
+            pushOperand(translator, value.type, value.index);
+            break;
+        }
+        case OP_POP_UNDER: {
+            int base = top - code[1];
+            Operand result = translator->stack[top];
+            RegisterInstruction* previous = previousInstruction(translator);
+            translator->depth = base + 1;
+            translator->stack[base] = result;
+
+            if (result.type == OPERAND_REGISTER && previous != NULL &&
+                writesA(REGISTER_OP(*previous)) && REGISTER_A(*previous) == (uint32_t)top)
+            {
+                // Retarget the instruction that computed the result.
+                *previous = (*previous & ~(RegisterInstruction)0xff00) | (RegisterInstruction)base << 8;
+                translator->stack[base].index = base;
+            }
+            else if (result.type == OPERAND_REGISTER || (result.type == OPERAND_LOCAL && result.index >= base))
+            {
+                // The registers above base are free from here on.
+                if (result.type == OPERAND_REGISTER) translator->stack[base].index = top;
+                translator->stack[base].type = OPERAND_LOCAL;
+                materialize(translator, base);
+            }
+            break;
+        }
+        case OP_RETURN:
+            emit(translator, REGISTER_ABC(ROP_RETURN, readRegister(translator, top), 0, 0));
+            translator->depth--;
+            break;
+        case OP_ADD_LOCALS: {
+            int a = localRegister(translator, code[1]);
+            int b = localRegister(translator, code[2]);
+            emit(translator, REGISTER_ABC(ROP_ADD, translator->depth, a, b));
+            pushOperand(translator, OPERAND_REGISTER, translator->depth);
+            break;
+        }
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_LESS_LOCAL_CONSTANT: {
+            uint8_t op = code[0] == OP_ADD_LOCAL_CONSTANT ? ROP_ADDK : ROP_LESSK;
+            int a = localRegister(translator, code[1]);
+            emit(translator, REGISTER_ABC(op, translator->depth, a, code[2]));
+            pushOperand(translator, OPERAND_REGISTER, translator->depth);
+            break;
+        }
+        case OP_INCREMENT_LOCAL: {
+            int a = localRegister(translator, code[1]);
+            materializeCopies(translator, a);
+            emit(translator, REGISTER_ABC(ROP_ADDK, a, a, code[2]));
+            break;
+        }
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+        case OP_LESS_LOCAL_CONSTANT_JUMP_OR_POP: {
+            // Pushes false and jumps when the comparison fails; the plain
+            // variant also pushes true when it falls through.
+            int target = jumpTarget(source, offset);
+            bool keepsResult = code[0] == OP_LESS_LOCAL_CONSTANT_JUMP;
+            int a = localRegister(translator, code[1]);
+
+            materializeAll(translator);
+            recordTarget(translator, target, translator->depth + 1);
+
+            bool resultUsed = !isPop(source, target) || (keepsResult && !isPop(source, offset + length));
+            if (resultUsed)
+            {
+                emit(translator, REGISTER_ABC(ROP_LESSK, translator->depth, a, code[2]));
+                emitJump(translator, REGISTER_ABC(ROP_JUMP_IF_FALSE, translator->depth, 0, 0), target);
+            }
+            else
+            {
+                emitJump(translator, REGISTER_ABC(ROP_JUMP_IF_NOT_LESSK, 0, a, code[2]), target);
+            }
+            if (keepsResult) pushOperand(translator, OPERAND_REGISTER, translator->depth);
+            break;
+        }
+        default:
+            translator->hadError = true;
+            break;
+    }
+}
+
+static bool translateChunk(ObjFunction* function)
+{
+    Chunk* source = &function->chunk;
+    RegisterChunk* chunk = &function->registerChunk;
+
+    Translator translator;
+    translator.source = source;
+    translator.chunk = chunk;
+    translator.line = 0;
+    translator.depth = 0;
+    translator.patches = NULL;
+    translator.patchCount = 0;
+    translator.patchCapacity = 0;
+    translator.lastInstruction = -1;
+    translator.blockStart = 0;
+    translator.hadError = false;
+
+    translator.wordAt = ALLOCATE(int, source->count + 1);
+    translator.depthAt = ALLOCATE(int, source->count + 1);
+    translator.isTarget = ALLOCATE(bool, source->count + 1);
+    for (int i = 0; i <= source->count; ++i)
+    {
+        translator.depthAt[i] = -1;
+        translator.isTarget[i] = false;
+    }
+    for (int offset = 0; offset < source->count; offset += instructionLength(source->code[offset]))
+    {
+        int target = jumpTarget(source, offset);
+        if (target != -1) translator.isTarget[target] = true;
+    }
+
+    // Slot zero holds the function itself, followed by the arguments.
+    for (int i = 0; i <= function->arity; ++i) pushOperand(&translator, OPERAND_REGISTER, i);
+    int registerCount = translator.depth;
+
+    bool reachable = true;
+    for (int offset = 0; offset < source->count && !translator.hadError;)
+    {
+        uint8_t instruction = source->code[offset];
+        translator.line = getLine(&source->lines, offset);
+
+        if (translator.isTarget[offset])
+        {
+            if (reachable) materializeAll(&translator);
+            else if (translator.depthAt[offset] != -1) translator.depth = translator.depthAt[offset];
+            for (int slot = 0; slot < translator.depth; ++slot)
+            {
+                translator.stack[slot].type = OPERAND_REGISTER;
+                translator.stack[slot].index = slot;
+            }
+            translator.blockStart = chunk->count;
+            reachable = true;
+        }
+        translator.wordAt[offset] = chunk->count;
+
+        translateInstruction(&translator, offset);
+        if (translator.depth < 0) translator.hadError = true;
+        if (translator.depth > registerCount) registerCount = translator.depth;
+
+        // Code after these is dead until the next jump target.
+        if (instruction == OP_JUMP || instruction == OP_LOOP || instruction == OP_RETURN) reachable = false;
+        offset += instructionLength(instruction);
+    }
+    translator.wordAt[source->count] = chunk->count;
+
+    for (int i = 0; i < translator.patchCount; ++i)
+    {
+        JumpPatch* patch = &translator.patches[i];
+        chunk->code[patch->word] = (RegisterInstruction)translator.wordAt[patch->stackOffset];
+    }
+
+    chunk->registerCount = registerCount;
+    if (registerCount > REGISTERS_MAX) translator.hadError = true;
+    finalizeLineArray(&chunk->lines);
+
+    FREE_ARRAY(JumpPatch, translator.patches, translator.patchCapacity);
+    FREE_ARRAY(bool, translator.isTarget, source->count + 1);
+    FREE_ARRAY(int, translator.depthAt, source->count + 1);
+    FREE_ARRAY(int, translator.wordAt, source->count + 1);
+
+    if (translator.hadError)
+    {
+        fprintf(stderr, "Cannot translate %s to registers.\n",
+            function->name != NULL ? function->name->chars : "script");
+        return false;
+    }
+
+#ifdef DEBUG_PRINT_CODE
+    disassembleRegisterChunk(function);
+#endif
+    return true;
+}
+
+bool translateFunction(ObjFunction* function)
+{
+    if (function->registerChunk.code != NULL) return true;
+    if (!translateChunk(function)) return false;
+
+    ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; ++i)
+    {
+        if (IS_FUNCTION(constants->values[i]) && !translateFunction(AS_FUNCTION(constants->values[i])))
+        {
+            return false;
+        }
+    }
+    return true;
+}
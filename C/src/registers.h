@@ -0,0 +1,117 @@
+#ifndef clox_registers_h
+#define clox_registers_h
+
+#include "common.h"
+#include "line.h"
+
+typedef struct sObjFunction ObjFunction;
+
+// Register instructions are 32-bit words: the opcode in the low byte,
+// followed by the A, B and C operand bytes. Bx is B and C read together
+// as a 16-bit index. Jumps carry their absolute target in an extra word.
+typedef uint32_t RegisterInstruction;
+
+#define REGISTER_OP(instruction) ((instruction) & 0xff)
+#define REGISTER_A(instruction)  (((instruction) >> 8) & 0xff)
+#define REGISTER_B(instruction)  (((instruction) >> 16) & 0xff)
+#define REGISTER_C(instruction)  ((instruction) >> 24)
+#define REGISTER_BX(instruction) ((instruction) >> 16)
+
+#define REGISTER_ABC(op, a, b, c) \
+    ((RegisterInstruction)(op) | (RegisterInstruction)(a) << 8 | \
+     (RegisterInstruction)(b) << 16 | (RegisterInstruction)(c) << 24)
+#define REGISTER_ABX(op, a, bx) \
+    ((RegisterInstruction)(op) | (RegisterInstruction)(a) << 8 | (RegisterInstruction)(bx) << 16)
+
+#define REGISTERS_MAX UINT8_COUNT
+
+typedef enum {
+    FORMAT_A,            // R[A] = ...
+    FORMAT_AB,           // R[A] = op R[B]
+    FORMAT_ABC,          // R[A] = R[B] op R[C]
+    FORMAT_ABK,          // R[A] = R[B] op K[C]
+    FORMAT_AK,           // R[A] = K[Bx]
+    FORMAT_AK_LONG,      // R[A] = K[next word]
+    FORMAT_AG,           // R[A] = global Bx
+    FORMAT_AG_LONG,      // R[A] = global next word
+    FORMAT_GLOBAL,       // global Bx = R[A]
+    FORMAT_GLOBAL_LONG,  // global next word = R[A]
+    FORMAT_SOURCE,       // reads R[A]
+    FORMAT_CALL,         // R[A] = R[A](R[A + 1] .. R[A + B])
+    FORMAT_INLINE_CALL,  // jump if R[A] is K[C], moving R[A + 1] .. R[A + B] down
+    FORMAT_JUMP,         // jump
+    FORMAT_TEST,         // jump depending on R[A]
+    FORMAT_COMPARE_JUMP, // jump depending on R[B] op R[C]
+    FORMAT_COMPARE_K_JUMP, // jump depending on R[B] op K[C]
+} RegisterFormat;
+
+#define REGISTER_OPCODE_LIST(X) \
+    X(ROP_MOVE, FORMAT_AB) \
+    X(ROP_LOADK, FORMAT_AK) \
+    X(ROP_LOADK_LONG, FORMAT_AK_LONG) \
+    X(ROP_NIL, FORMAT_A) \
+    X(ROP_TRUE, FORMAT_A) \
+    X(ROP_FALSE, FORMAT_A) \
+    X(ROP_GET_GLOBAL, FORMAT_AG) \
+    X(ROP_GET_GLOBAL_LONG, FORMAT_AG_LONG) \
+    X(ROP_SET_GLOBAL, FORMAT_GLOBAL) \
+    X(ROP_SET_GLOBAL_LONG, FORMAT_GLOBAL_LONG) \
+    X(ROP_DEFINE_GLOBAL, FORMAT_GLOBAL) \
+    X(ROP_DEFINE_GLOBAL_LONG, FORMAT_GLOBAL_LONG) \
+    X(ROP_ADD, FORMAT_ABC) \
+    X(ROP_SUBSTRACT, FORMAT_ABC) \
+    X(ROP_MULTIPLY, FORMAT_ABC) \
+    X(ROP_DIVIDE, FORMAT_ABC) \
+    X(ROP_EQUAL, FORMAT_ABC) \
+    X(ROP_NOT_EQUAL, FORMAT_ABC) \
+    X(ROP_GREATER, FORMAT_ABC) \
+    X(ROP_LESS, FORMAT_ABC) \
+    X(ROP_ADDK, FORMAT_ABK) \
+    X(ROP_SUBSTRACTK, FORMAT_ABK) \
+    X(ROP_MULTIPLYK, FORMAT_ABK) \
+    X(ROP_DIVIDEK, FORMAT_ABK) \
+    X(ROP_EQUALK, FORMAT_ABK) \
+    X(ROP_NOT_EQUALK, FORMAT_ABK) \
+    X(ROP_GREATERK, FORMAT_ABK) \
+    X(ROP_LESSK, FORMAT_ABK) \
+    X(ROP_NEGATE, FORMAT_AB) \
+    X(ROP_NOT, FORMAT_AB) \
+    X(ROP_PRINT, FORMAT_SOURCE) \
+    X(ROP_JUMP, FORMAT_JUMP) \
+    X(ROP_JUMP_IF_FALSE, FORMAT_TEST) \
+    X(ROP_JUMP_IF_NOT_LESS, FORMAT_COMPARE_JUMP) \
+    X(ROP_JUMP_IF_NOT_GREATER, FORMAT_COMPARE_JUMP) \
+    X(ROP_JUMP_IF_NOT_LESSK, FORMAT_COMPARE_K_JUMP) \
+    X(ROP_JUMP_IF_NOT_GREATERK, FORMAT_COMPARE_K_JUMP) \
+    X(ROP_CALL, FORMAT_CALL) \
+    X(ROP_TAIL_CALL, FORMAT_CALL) \
+    X(ROP_INLINE_CALL, FORMAT_INLINE_CALL) \
+    X(ROP_RETURN, FORMAT_SOURCE)
+
+typedef enum {
+#define REGISTER_OPCODE_ENUM(name, format) name,
+    REGISTER_OPCODE_LIST(REGISTER_OPCODE_ENUM)
+#undef REGISTER_OPCODE_ENUM
+    ROP_COUNT,
+} RegisterOpCode;
+
+// Register form of a function's code. Constants are shared with the
+// stack chunk, and lines are recorded per instruction word.
+typedef struct {
+    int count;
+    int capacity;
+    RegisterInstruction* code;
+    LineArray lines;
+    int registerCount;
+} RegisterChunk;
+
+void initRegisterChunk(RegisterChunk* chunk);
+void freeRegisterChunk(RegisterChunk* chunk);
+RegisterFormat registerFormat(uint8_t instruction);
+int registerInstructionLength(uint8_t instruction);
+
+// Translates the stack bytecode of function, and of every function
+// nested in its constants, into register code.
+bool translateFunction(ObjFunction* function);
+
+#endif
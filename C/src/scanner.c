@@ -4,254 +4,390 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef USE_SSE2
+#include <emmintrin.h>
+#endif
 
-typedef struct {
-
-    const char *start;
-    const char *current;
-    int line;
-
-} Scanner;
-
-Scanner scanner;
 
-static Token errorToken(const char * message)
+static Token errorToken(Scanner* scanner, const char * message)
 {
     Token token;
     
     token.type = TOKEN_ERROR;
     token.start = message;
     token.length = (int)strlen(message);
-    token.line = scanner.line;
+    token.line = scanner->line;
 
     return token;
 }
 
-static bool isAtEnd()
+static bool isAtEnd(Scanner* scanner)
 {
-    return *scanner.current == 0;
+    return *scanner->current == 0;
 }
 
-static Token makeToken(TokenType type)
+static Token makeToken(Scanner* scanner, TokenType type)
 {
     Token token;
 
     token.type = type;
-    token.start = scanner.start;
-    token.length = (int)(scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
+    token.line = scanner->line;
 
     return token;
 }
 
-void initScanner(const char * source)
+void initScanner(Scanner* scanner, const char* start, const char* end)
 {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+    scanner->start = start;
+    scanner->current = start;
+    scanner->end = end;
+    scanner->line = 1;
 }
 
-static char advance()
+static char advance(Scanner* scanner)
 {
-    scanner.current++;
-    return scanner.current[-1];
+    scanner->current++;
+    return scanner->current[-1];
 
 }
 
-static bool match(char expected)
+static bool match(Scanner* scanner, char expected)
 {
-    if (isAtEnd() || expected != *scanner.current) return false;
+    if (isAtEnd(scanner) || expected != *scanner->current) return false;
 
-    ++scanner.current;
+    ++scanner->current;
     return true;
 }
 
-static char peek()
+static char peek(Scanner* scanner)
 {
-    return *scanner.current;
+    return *scanner->current;
 }
 
-static char peekNext()
+static char peekNext(Scanner* scanner)
 {
-    if (!isAtEnd()) return scanner.current[1];
+    if (!isAtEnd(scanner)) return scanner->current[1];
     return 0;
 
 }
 
-static void skipWhitespace()
+static bool isDigit(char c)
 {
-    for (;;)
+    return c <= '9' && c >= '0';
+}
+
+static bool isAlpha(char c)
+{
+    return (c >= 'A' && c <= 'Z')  ||
+           (c >= 'a' && c <= 'z')  ||
+           c == '_';
+}
+
+static bool isAlphanumeric(char c)
+{
+    return isDigit(c) || isAlpha(c);
+}
+
+// Runs of blanks, comments, string bodies, identifiers and numbers are
+// classified a block at a time while a whole block is left before the
+// end, and the byte loops finish whatever is left. They work on a local
+// copy of current, since a store through a char pointer could change it.
+#ifdef USE_SSE2
+
+#define BLOCK_WIDTH 16
+#define BLOCK_FULL 0xffffu
+
+static bool blockLeft(Scanner* scanner, const char* current)
+{
+    return scanner->end - current >= BLOCK_WIDTH;
+}
+
+static __m128i loadBlock(const char* current)
+{
+    return _mm_loadu_si128((const __m128i*)current);
+}
+
+// Bit i is set when byte i of the block is c.
+static uint32_t matchChar(__m128i block, char c)
+{
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+}
+
+// Bytes from 0x80 up are negative, so they fall outside every range.
+static uint32_t matchRange(__m128i block, char low, char high)
+{
+    __m128i above = _mm_cmpgt_epi8(block, _mm_set1_epi8((char)(low - 1)));
+    __m128i below = _mm_cmplt_epi8(block, _mm_set1_epi8((char)(high + 1)));
+    return (uint32_t)_mm_movemask_epi8(_mm_and_si128(above, below));
+}
+
+// Newlines before the first byte flagged in stop, or in the whole block.
+static int countLines(uint32_t newlines, uint32_t stop)
+{
+    return __builtin_popcount(newlines & ((stop & -stop) - 1));
+}
+
+#endif
+
+static void skipBlanks(Scanner* scanner)
+{
+    const char* current = scanner->current;
+    int line = scanner->line;
+
+#ifdef USE_SSE2
+    // Most runs are a single space, which is not worth a block.
+    if (current[0] != ' ' || current[1] == ' ' || current[1] == '\n')
     {
-        char c = peek();
-        switch (c)
+        for (; blockLeft(scanner, current); current += BLOCK_WIDTH)
         {
-            case '\n':
-                ++scanner.line;
-            case ' ':
-            case '\t':
-            case '\r':
-                advance();
-                break;
-            case '/':
-                if (peekNext() == '/')
-                {
-                    while (peek() != '\n' && !isAtEnd()) advance();
-                }
-                else
-                {
-                    return;
-                }
+            __m128i block = loadBlock(current);
+            uint32_t newlines = matchChar(block, '\n');
+            uint32_t blanks = newlines | matchChar(block, ' ') | matchChar(block, '\t') | matchChar(block, '\r');
+            uint32_t stop = ~blanks & BLOCK_FULL;
+            line += countLines(newlines, stop);
+            if (stop != 0)
+            {
+                current += __builtin_ctz(stop);
                 break;
-
-            default:
-                return;
+            }
         }
+    }
+#endif
 
+    for (;; current++)
+    {
+        if (*current == '\n') line++;
+        else if (*current != ' ' && *current != '\t' && *current != '\r') break;
     }
+
+    scanner->current = current;
+    scanner->line = line;
 }
 
-static Token string()
+// Stops on the newline, which is left for skipBlanks() to count.
+static void skipComment(Scanner* scanner)
 {
-    while (!isAtEnd() && peek() != '"')
+    const char* current = scanner->current;
+
+#ifdef USE_SSE2
+    for (; blockLeft(scanner, current); current += BLOCK_WIDTH)
     {
-        if (peek() == '\n') ++scanner.line;
-        advance();
+        uint32_t stop = matchChar(loadBlock(current), '\n');
+        if (stop != 0)
+        {
+            current += __builtin_ctz(stop);
+            break;
+        }
     }
+#endif
+
+    while (*current != '\n' && current != scanner->end) current++;
+    scanner->current = current;
+}
 
-    if (isAtEnd())
+static void skipStringBody(Scanner* scanner)
+{
+    const char* current = scanner->current;
+    int line = scanner->line;
+
+#ifdef USE_SSE2
+    for (; blockLeft(scanner, current); current += BLOCK_WIDTH)
     {
-        return errorToken("Unterminated string.");
+        __m128i block = loadBlock(current);
+        uint32_t stop = matchChar(block, '"');
+        line += countLines(matchChar(block, '\n'), stop);
+        if (stop != 0)
+        {
+            current += __builtin_ctz(stop);
+            break;
+        }
     }
+#endif
 
-    // Closing quote
-    advance();
-    return makeToken(TOKEN_STRING);
+    for (; *current != '"' && current != scanner->end; current++)
+    {
+        if (*current == '\n') line++;
+    }
+
+    scanner->current = current;
+    scanner->line = line;
 }
 
-static bool isDigit(char c)
+static void skipAlphanumeric(Scanner* scanner)
 {
-    return c <= '9' && c >= '0';
+    const char* current = scanner->current;
+
+#ifdef USE_SSE2
+    for (; blockLeft(scanner, current); current += BLOCK_WIDTH)
+    {
+        __m128i block = loadBlock(current);
+        // Setting bit 5 folds upper case onto lower case.
+        __m128i folded = _mm_or_si128(block, _mm_set1_epi8(0x20));
+        uint32_t alphanumeric = matchRange(folded, 'a', 'z') | matchRange(block, '0', '9') | matchChar(block, '_');
+        uint32_t stop = ~alphanumeric & BLOCK_FULL;
+        if (stop != 0)
+        {
+            current += __builtin_ctz(stop);
+            break;
+        }
+    }
+#endif
+
+    while (isAlphanumeric(*current)) current++;
+    scanner->current = current;
 }
 
-static bool isAlpha(char c)
+static void skipDigits(Scanner* scanner)
 {
-    return (c >= 'A' && c <= 'Z')  ||
-           (c >= 'a' && c <= 'z')  ||
-           c == '_';
+    const char* current = scanner->current;
+
+#ifdef USE_SSE2
+    for (; blockLeft(scanner, current); current += BLOCK_WIDTH)
+    {
+        uint32_t stop = ~matchRange(loadBlock(current), '0', '9') & BLOCK_FULL;
+        if (stop != 0)
+        {
+            current += __builtin_ctz(stop);
+            break;
+        }
+    }
+#endif
+
+    while (isDigit(*current)) current++;
+    scanner->current = current;
 }
 
-static bool isAlphanumeric(char c)
+static void skipWhitespace(Scanner* scanner)
 {
-    return isDigit(c) || isAlpha(c);
+    for (;;)
+    {
+        skipBlanks(scanner);
+        if (peek(scanner) != '/' || peekNext(scanner) != '/') return;
+        skipComment(scanner);
+    }
 }
 
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type)
+static Token string(Scanner* scanner)
 {
-    if (scanner.current - scanner.start == start + length &&
-        memcmp(scanner.start + start, rest, length) == 0)
+    skipStringBody(scanner);
+
+    if (isAtEnd(scanner))
     {
-        return type;
+        return errorToken(scanner, "Unterminated string.");
     }
-    return TOKEN_IDENTIFIER;
+
+    // Closing quote
+    advance(scanner);
+    return makeToken(scanner, TOKEN_STRING);
 }
 
-static TokenType idenditifierType()
+typedef struct {
+    const char* name;
+    int length;
+    TokenType type;
+} Keyword;
+
+// Perfect for the keywords below; every keyword is at least two long.
+#define KEYWORD_HASH(first, second, length) (((first) * 7 + (second) * 14 + (length)) & 31)
+
+// The first two characters are spelled out to keep the index constant.
+#define KEYWORD(first, second, name, type) \
+    [KEYWORD_HASH(first, second, sizeof(name) - 1)] = {name, sizeof(name) - 1, type}
+
+static const Keyword keywords[32] = {
+    KEYWORD('a', 'n', "and", TOKEN_AND),
+    KEYWORD('c', 'l', "class", TOKEN_CLASS),
+    KEYWORD('e', 'l', "else", TOKEN_ELSE),
+    KEYWORD('f', 'a', "false", TOKEN_FALSE),
+    KEYWORD('f', 'o', "for", TOKEN_FOR),
+    KEYWORD('f', 'u', "fun", TOKEN_FUN),
+    KEYWORD('i', 'f', "if", TOKEN_IF),
+    KEYWORD('i', 'm', "import", TOKEN_IMPORT),
+    KEYWORD('n', 'i', "nil", TOKEN_NIL),
+    KEYWORD('o', 'r', "or", TOKEN_OR),
+    KEYWORD('p', 'r', "print", TOKEN_PRINT),
+    KEYWORD('r', 'e', "return", TOKEN_RETURN),
+    KEYWORD('s', 'u', "super", TOKEN_SUPER),
+    KEYWORD('t', 'h', "this", TOKEN_THIS),
+    KEYWORD('t', 'r', "true", TOKEN_TRUE),
+    KEYWORD('v', 'a', "var", TOKEN_VAR),
+    KEYWORD('w', 'h', "while", TOKEN_WHILE),
+};
+
+#undef KEYWORD
+
+static TokenType idenditifierType(Scanner* scanner)
 {
-    switch (scanner.start[0])
+    int length = (int)(scanner->current - scanner->start);
+    if (length < 2) return TOKEN_IDENTIFIER;
+
+    // Empty slots have length zero, so they never match.
+    const Keyword* keyword = &keywords[KEYWORD_HASH((uint8_t)scanner->start[0], (uint8_t)scanner->start[1], length)];
+    if (keyword->length == length && memcmp(scanner->start, keyword->name, length) == 0)
     {
-        case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND); 
-        case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-        case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-        case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-        case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
-        case 'f':
-            if (scanner.current - scanner.start > 1)
-            {
-                switch (scanner.start[1])
-                {
-                    case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-                    case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
-                }
-            }
-            break;
-        case 't':
-            if (scanner.current - scanner.start > 1 )
-            {
-                switch (scanner.start[1])
-                {
-                    case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-                    case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-                }
-            }
-            break;
+        return keyword->type;
     }
-
     return TOKEN_IDENTIFIER;
 }
 
-static Token idenditifier()
+static Token idenditifier(Scanner* scanner)
 {
-    while (isAlphanumeric(peek())) advance();
+    skipAlphanumeric(scanner);
 
-    return makeToken(idenditifierType());
+    return makeToken(scanner, idenditifierType(scanner));
 }
 
-static Token number()
+static Token number(Scanner* scanner)
 {
-    while (isDigit(peek())) advance();
+    skipDigits(scanner);
 
-    if (peek() == '.' && isDigit(peekNext()))
+    if (peek(scanner) == '.' && isDigit(peekNext(scanner)))
     {
-        advance();
-        while (isDigit(peek())) advance();
+        advance(scanner);
+        skipDigits(scanner);
     }
 
-    return makeToken(TOKEN_NUMBER);
+    return makeToken(scanner, TOKEN_NUMBER);
 }
 
 
-Token scanToken()
+Token scanToken(Scanner* scanner)
 {
-    skipWhitespace();
+    skipWhitespace(scanner);
 
-    scanner.start = scanner.current;
+    scanner->start = scanner->current;
 
-    if (isAtEnd()) return makeToken(TOKEN_EOF);
+    if (isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
 
-    char c = advance();
+    char c = advance(scanner);
 
-    if (isAlpha(c)) return idenditifier();
-    if (isDigit(c)) return number();
+    if (isAlpha(c)) return idenditifier(scanner);
+    if (isDigit(c)) return number(scanner);
 
     switch (c)
     {
-        case '(': return makeToken(TOKEN_LEFT_PAREN);
-        case ')': return makeToken(TOKEN_RIGHT_PAREN);
-        case '{': return makeToken(TOKEN_LEFT_BRACE);
-        case '}': return makeToken(TOKEN_RIGHT_BRACE);
-        case ';': return makeToken(TOKEN_SEMICOLON);
-        case ',': return makeToken(TOKEN_COMMA);
-        case '.': return makeToken(TOKEN_DOT);
-        case '-': return makeToken(TOKEN_MINUS);
-        case '+': return makeToken(TOKEN_PLUS);
-        case '*': return makeToken(TOKEN_STAR);
-        case '/': return makeToken(TOKEN_SLASH);
-
-        case '!': return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
-        case '=': return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
-        case '<': return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
-        case '>': return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
-
-        case '"': return string();
+        case '(': return makeToken(scanner, TOKEN_LEFT_PAREN);
+        case ')': return makeToken(scanner, TOKEN_RIGHT_PAREN);
+        case '{': return makeToken(scanner, TOKEN_LEFT_BRACE);
+        case '}': return makeToken(scanner, TOKEN_RIGHT_BRACE);
+        case ';': return makeToken(scanner, TOKEN_SEMICOLON);
+        case ',': return makeToken(scanner, TOKEN_COMMA);
+        case '.': return makeToken(scanner, TOKEN_DOT);
+        case '-': return makeToken(scanner, TOKEN_MINUS);
+        case '+': return makeToken(scanner, TOKEN_PLUS);
+        case '*': return makeToken(scanner, TOKEN_STAR);
+        case '/': return makeToken(scanner, TOKEN_SLASH);
+
+        case '!': return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+        case '=': return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+        case '<': return makeToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+        case '>': return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+
+        case '"': return string(scanner);
 
     }
-    return errorToken("Unexpected character");
+    return errorToken(scanner, "Unexpected character");
 
 }
@@ -39,6 +39,7 @@ typedef enum
     TOKEN_FOR,
     TOKEN_FUN,
     TOKEN_IF,
+    TOKEN_IMPORT,
     TOKEN_NIL,
     TOKEN_OR,
     TOKEN_PRINT,
@@ -62,7 +63,17 @@ typedef struct
     int line;
 } Token;
 
-void initScanner(const char* source);
-Token scanToken();
+typedef struct {
+    const char* start;
+    const char* current;
+    // The terminator, so block reads never run past the source.
+    const char* end;
+    int line;
+} Scanner;
+
+// Scans from start, on line 1, up to the zero byte at end. Scanners share
+// no state, so several can run at once over one source.
+void initScanner(Scanner* scanner, const char* start, const char* end);
+Token scanToken(Scanner* scanner);
 
 #endif
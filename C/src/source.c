@@ -0,0 +1,111 @@
+#include "source.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Regular files are mapped rather than copied. The zero after the text is
+// either the rest of the last page, which the kernel fills with zeros, or
+// an anonymous page reserved behind the file when it ends on a boundary.
+static bool mapSource(int fd, size_t size, Source* source)
+{
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mappedSize = (size + pageSize) & ~(pageSize - 1);
+
+    char* chars = (char*)mmap(NULL, mappedSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chars == MAP_FAILED) return false;
+    if (size > 0 && mmap(chars, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        munmap(chars, mappedSize);
+        return false;
+    }
+    madvise(chars, size, MADV_SEQUENTIAL);
+
+    source->chars = chars;
+    source->length = size;
+    source->mappedSize = mappedSize;
+    return true;
+}
+
+// Pipes and terminals have no size up front, so they are read in growing
+// blocks until the end.
+static bool readStream(FILE* file, Source* source)
+{
+    size_t capacity = 4096;
+    size_t length = 0;
+    char* chars = (char*)malloc(capacity);
+    if (chars == NULL) return false;
+
+    for (;;)
+    {
+        if (length + 1 == capacity)
+        {
+            capacity *= 2;
+            char* grown = (char*)realloc(chars, capacity);
+            if (grown == NULL)
+            {
+                free(chars);
+                return false;
+            }
+            chars = grown;
+        }
+
+        size_t bytesRead = fread(chars + length, sizeof(char), capacity - length - 1, file);
+        if (bytesRead == 0) break;
+        length += bytesRead;
+    }
+    chars[length] = 0;
+
+    if (ferror(file))
+    {
+        free(chars);
+        return false;
+    }
+    source->chars = chars;
+    source->length = length;
+    source->mappedSize = 0;
+    return true;
+}
+
+void freeSource(Source* source)
+{
+    if (source->mappedSize > 0)
+    {
+        munmap(source->chars, source->mappedSize);
+    }
+    else
+    {
+        free(source->chars);
+    }
+}
+
+bool readSource(const char* path, Source* source)
+{
+    FILE* file = fopen(path, "rb");
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return false;
+    }
+
+    struct stat status;
+    source->regular = fstat(fileno(file), &status) == 0 && S_ISREG(status.st_mode);
+    if (!(source->regular && mapSource(fileno(file), (size_t)status.st_size, source)) &&
+        !readStream(file, source))
+    {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        fclose(file);
+        return false;
+    }
+
+    if (fclose(file) == EOF)
+    {
+        fprintf(stderr, "Could not close file \"%s\".\n", path);
+        freeSource(source);
+        return false;
+    }
+    return true;
+}
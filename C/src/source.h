@@ -0,0 +1,21 @@
+#ifndef clox_source_h
+#define clox_source_h
+
+#include "common.h"
+
+// A script's text, followed by at least one zero byte.
+typedef struct {
+    char* chars;
+    size_t length;
+    // Zero when chars came from malloc().
+    size_t mappedSize;
+    // Only regular files are cached: their path names the same source
+    // next time.
+    bool regular;
+} Source;
+
+// Reports the problem on stderr and returns false when path cannot be read.
+bool readSource(const char* path, Source* source);
+void freeSource(Source* source);
+
+#endif
@@ -6,105 +6,194 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define TABLE_MAX_LOAD 0.75
+#ifdef USE_SSE2
+#include <emmintrin.h>
+#endif
+
+// Slots used by live keys and tombstones together. Groups make a probe
+// cheap enough to run the table fuller than the usual 0.75.
+#define TABLE_MAX_LOAD 0.875
+
+#define GROUP_WIDTH 16
+
+// Full slots store the top seven bits of the hash, so the top bit of a
+// control byte marks the two free states. The low bits pick the group.
+#define CONTROL_EMPTY ((uint8_t)0x80)
+#define CONTROL_DELETED ((uint8_t)0xfe)
+
+#define HASH_FRAGMENT(hash) ((uint8_t)((hash) >> 25))
+#define HASH_GROUP(hash) (hash)
+
+// Bit i is set when slot i of the group matches.
+typedef uint32_t GroupMatch;
+
+static GroupMatch matchByte(const uint8_t* group, uint8_t byte)
+{
+#ifdef USE_SSE2
+    __m128i control = _mm_loadu_si128((const __m128i*)group);
+    return (GroupMatch)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+#else
+    GroupMatch match = 0;
+    for (int i = 0; i < GROUP_WIDTH; ++i)
+    {
+        if (group[i] == byte) match |= (GroupMatch)1 << i;
+    }
+    return match;
+#endif
+}
+
+// Empty or deleted slots.
+static GroupMatch matchFree(const uint8_t* group)
+{
+#ifdef USE_SSE2
+    return (GroupMatch)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+    GroupMatch match = 0;
+    for (int i = 0; i < GROUP_WIDTH; ++i)
+    {
+        if (group[i] & 0x80) match |= (GroupMatch)1 << i;
+    }
+    return match;
+#endif
+}
+
+static int firstMatch(GroupMatch match)
+{
+#ifdef __GNUC__
+    return __builtin_ctz(match);
+#else
+    int index = 0;
+    while (!(match & 1))
+    {
+        match >>= 1;
+        index++;
+    }
+    return index;
+#endif
+}
+
+// Groups are probed triangularly: 0, 1, 3, 6, ... groups past the home
+// group, which visits every group once when their count is a power of two.
+#define FOR_EACH_GROUP(table, hash, group) \
+    for (uint32_t groupMask = (uint32_t)(table)->capacity / GROUP_WIDTH - 1, \
+             group = HASH_GROUP(hash) & groupMask, stride = 1; ; \
+         group = (group + stride++) & groupMask)
 
 void initTable(Table* table)
 {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
+    table->control = NULL;
     table->entries = NULL;
 }
 
 void freeTable(Table* table)
 {
+   FREE_ARRAY(uint8_t, table->control, table->capacity);
    FREE_ARRAY(Entry, table->entries, table->capacity);
    initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key)
+static int findEntry(Table* table, ObjString* key)
 {
-    uint32_t index = key->hash % capacity;
+    uint8_t fragment = HASH_FRAGMENT(key->hash);
 
-    Entry* tombstone = NULL;
-    for (;;)
+    FOR_EACH_GROUP(table, key->hash, group)
     {
-        Entry* entry = &entries[index];
-
-        if (entry->key == NULL)
-        {
-            if (IS_NIL(entry->value))
-            {
-                return tombstone ? tombstone : entry;
-            }
-            else
-            {
-                if (tombstone == NULL) tombstone = entry;
-            }
-        }
-        else if (entry->key == key)
+        const uint8_t* control = &table->control[group * GROUP_WIDTH];
+        for (GroupMatch match = matchByte(control, fragment); match != 0; match &= match - 1)
         {
-            return entry;
+            int index = (int)group * GROUP_WIDTH + firstMatch(match);
+            if (table->entries[index].key == key) return index;
         }
 
-        index = (index + 1) % capacity;
+        // A probe only moves past groups that had no empty slot when the
+        // key was inserted.
+        if (matchByte(control, CONTROL_EMPTY)) return -1;
+    }
+}
+
+static int findFreeSlot(Table* table, uint32_t hash)
+{
+    FOR_EACH_GROUP(table, hash, group)
+    {
+        GroupMatch match = matchFree(&table->control[group * GROUP_WIDTH]);
+        if (match) return (int)group * GROUP_WIDTH + firstMatch(match);
     }
 }
 
+// Rebuilding drops every tombstone, so a table that is mostly tombstones
+// is rehashed in place rather than grown.
 static void adjustCapacity(Table* table, int capacity)
 {
+    uint8_t* control = ALLOCATE(uint8_t, capacity);
     Entry* entries = ALLOCATE(Entry, capacity);
+    memset(control, CONTROL_EMPTY, capacity);
 
-    for (int i = 0 ; i < capacity; ++i)
-    {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
-    }
+    Table resized;
+    resized.count = 0;
+    resized.tombstones = 0;
+    resized.capacity = capacity;
+    resized.control = control;
+    resized.entries = entries;
 
-    table->count = 0;
     for (int i = 0; i < table->capacity; ++i)
     {
-        Entry* entry = &table->entries[i];
-        if (entry->key == NULL) continue;
+        if (table->control[i] & 0x80) continue;
 
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        Entry* entry = &table->entries[i];
+        int index = findFreeSlot(&resized, entry->key->hash);
+        control[index] = table->control[i];
+        entries[index] = *entry;
+        resized.count++;
     }
 
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
     FREE_ARRAY(Entry, table->entries, table->capacity);
-    table->entries = entries;
-    table->capacity = capacity;
+    *table = resized;
 }
 
 bool tableSet(Table* table, ObjString* key, Value value)
 {
-    if (table->capacity * TABLE_MAX_LOAD < table->count + 1)
+    if (table->count > 0)
     {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+        int index = findEntry(table, key);
+        if (index >= 0)
+        {
+            table->entries[index].value = value;
+            return false;
+        }
     }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-
-    bool isNewKey = entry->key == NULL;
+    if (table->capacity * TABLE_MAX_LOAD < table->count + table->tombstones + 1)
+    {
+        int capacity = table->capacity;
+        if (capacity * TABLE_MAX_LOAD < (table->count + 1) * 2)
+        {
+            capacity = capacity < GROUP_WIDTH ? GROUP_WIDTH : capacity * 2;
+        }
+        adjustCapacity(table, capacity);
+    }
 
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
+    int index = findFreeSlot(table, key->hash);
+    if (table->control[index] == CONTROL_DELETED) table->tombstones--;
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;;
+    table->control[index] = HASH_FRAGMENT(key->hash);
+    table->entries[index].key = key;
+    table->entries[index].value = value;
+    table->count++;
+    return true;
 }
 
 void tableAddAll(Table* from, Table* to)
 {
     for (int i = 0; i < from->capacity; ++i)
     {
+        if (from->control[i] & 0x80) continue;
+
         Entry* entry = &from->entries[i];
-        if (entry->key)
-        {
-            tableSet(to, entry->key, entry->value);
-        }
+        tableSet(to, entry->key, entry->value);
     }
 }
 
@@ -113,46 +202,86 @@ bool tableGet(Table* table, ObjString* key, Value* value)
 {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int index = findEntry(table, key);
+    if (index < 0) return false;
 
-    *value = entry->value;
+    *value = table->entries[index].value;
     return true;
 }
 
+static void deleteSlot(Table* table, int index)
+{
+    // A group that still has an empty slot never made a probe move on, so
+    // the slot can go straight back to empty instead of a tombstone.
+    const uint8_t* group = &table->control[index & ~(GROUP_WIDTH - 1)];
+    if (matchByte(group, CONTROL_EMPTY))
+    {
+        table->control[index] = CONTROL_EMPTY;
+    }
+    else
+    {
+        table->control[index] = CONTROL_DELETED;
+        table->tombstones++;
+    }
+
+    table->entries[index].key = NULL;
+    table->entries[index].value = NIL_VAL;
+    table->count--;
+}
+
 bool tableDelete(Table* table, ObjString* key)
 {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
-
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    int index = findEntry(table, key);
+    if (index < 0) return false;
 
+    deleteSlot(table, index);
     return true;
 
 }
 
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash)
 {
-    if (table->count == 0) return false;
+    if (table->count == 0) return NULL;
 
-    uint32_t index = hash % table->capacity;
+    uint8_t fragment = HASH_FRAGMENT(hash);
 
-    for (;;)
+    FOR_EACH_GROUP(table, hash, group)
     {
-        Entry* entry = &table->entries[index];
-
-        if (entry->key == NULL && IS_NIL(entry->value))
+        const uint8_t* control = &table->control[group * GROUP_WIDTH];
+        for (GroupMatch match = matchByte(control, fragment); match != 0; match &= match - 1)
         {
-            return NULL;
-        }
-        else if (entry->key->hash == hash && entry->key->length == length && memcmp(chars, entry->key->chars, length) == 0)
-        {
-            return entry->key;
+            ObjString* key = table->entries[group * GROUP_WIDTH + firstMatch(match)].key;
+            if (key->hash == hash && key->length == length && memcmp(chars, key->chars, length) == 0)
+            {
+                return key;
+            }
         }
-        index = (index + 1) % table->capacity;
+
+        if (matchByte(control, CONTROL_EMPTY)) return NULL;
+    }
+}
+
+
+void tableRemoveWhite(Table* table)
+{
+    for (int i = 0; i < table->capacity; ++i)
+    {
+        if (table->control[i] & 0x80) continue;
+
+        if (!table->entries[i].key->obj.isMarked) deleteSlot(table, i);
     }
 }
 
+void markTable(Table* table)
+{
+    for (int i = 0; i < table->capacity; ++i)
+    {
+        if (table->control[i] & 0x80) continue;
+
+        Entry* entry = &table->entries[i];
+        markObject((Obj*)entry->key);
+        markValue(entry->value);
+    }
+}
@@ -8,9 +8,15 @@ typedef struct {
     Value value;
 } Entry;
 
+// Swiss-table layout: one control byte per slot, either EMPTY, DELETED or
+// the top seven bits of the key's hash, kept apart from the entries so a
+// probe can test a whole group of slots at once. The capacity is zero or
+// a power of two no smaller than a group.
 typedef struct {
     int count;
+    int tombstones;
     int capacity;
+    uint8_t* control;
     Entry* entries;
 } Table;
 
@@ -21,5 +27,7 @@ void tableAddAll(Table* from, Table* to);
 bool tableGet(Table* table, ObjString* key, Value* value);
 bool tableDelete(Table* table, ObjString* key);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
+void tableRemoveWhite(Table* table);
+void markTable(Table* table);
 
 #endif
@@ -0,0 +1,252 @@
+#include "memory.h"
+#include "tokens.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef NO_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// Token arrays are filled on scanning threads, so they are allocated
+// outside the collector's accounting.
+static void* growField(void* field, size_t size, int capacity)
+{
+    void* result = realloc(field, size * capacity);
+    if (result == NULL) exit(1);
+    return result;
+}
+
+void initTokenArray(TokenArray* tokens, const char* source, const char* end)
+{
+    tokens->source = source;
+    tokens->end = end;
+    tokens->count = 0;
+    tokens->capacity = 0;
+    tokens->types = NULL;
+    tokens->starts = NULL;
+    tokens->lengths = NULL;
+    tokens->lines = NULL;
+}
+
+void freeTokenArray(TokenArray* tokens)
+{
+    free(tokens->types);
+    free(tokens->starts);
+    free(tokens->lengths);
+    free(tokens->lines);
+    initTokenArray(tokens, tokens->source, tokens->end);
+}
+
+static void reserveTokens(TokenArray* tokens, int count)
+{
+    if (tokens->capacity >= count) return;
+
+    int capacity = GROW_CAPACITY(tokens->capacity);
+    if (capacity < count) capacity = count;
+    tokens->types = (uint8_t*)growField(tokens->types, sizeof(uint8_t), capacity);
+    tokens->starts = (int*)growField(tokens->starts, sizeof(int), capacity);
+    tokens->lengths = (int*)growField(tokens->lengths, sizeof(int), capacity);
+    tokens->lines = (int*)growField(tokens->lines, sizeof(int), capacity);
+    tokens->capacity = capacity;
+}
+
+static void writeToken(TokenArray* tokens, const Token* token, int start)
+{
+    reserveTokens(tokens, tokens->count + 1);
+    tokens->types[tokens->count] = (uint8_t)token->type;
+    tokens->starts[tokens->count] = start;
+    tokens->lengths[tokens->count] = token->length;
+    tokens->lines[tokens->count] = token->line;
+    tokens->count++;
+}
+
+// A token's line is where it ends, so strings spanning lines are counted
+// back to the line they start on.
+static int startLine(const Scanner* scanner, const Token* token)
+{
+    int line = token->line;
+    for (const char* c = scanner->start; c < scanner->current; ++c)
+    {
+        if (*c == '\n') line--;
+    }
+    return line;
+}
+
+// One stretch of the source. The piece keeps the tokens starting before
+// limit, and notes the first token it scanned and the first one it left
+// for the next piece, so the pieces can be checked against each other.
+typedef struct {
+    const char* source;
+    const char* end;
+    int begin;
+    int line;
+    int limit;
+
+    TokenArray tokens;
+    int firstStart;
+    int firstLine;
+    int stopStart;
+    int stopLine;
+} Piece;
+
+static void* scanPiece(void* argument)
+{
+    Piece* piece = (Piece*)argument;
+
+    Scanner scanner;
+    initScanner(&scanner, piece->source + piece->begin, piece->end);
+    scanner.line = piece->line;
+    initTokenArray(&piece->tokens, piece->source, piece->end);
+
+    for (bool first = true; ; first = false)
+    {
+        Token token = scanToken(&scanner);
+        int start = (int)(scanner.start - piece->source);
+        if (first)
+        {
+            piece->firstStart = start;
+            piece->firstLine = startLine(&scanner, &token);
+        }
+        if (start >= piece->limit)
+        {
+            piece->stopStart = start;
+            piece->stopLine = startLine(&scanner, &token);
+            break;
+        }
+
+        writeToken(&piece->tokens, &token, start);
+        if (token.type == TOKEN_EOF) break;
+    }
+
+    return NULL;
+}
+
+static void appendPiece(TokenArray* tokens, Piece* piece, int lineDelta)
+{
+    TokenArray* from = &piece->tokens;
+    reserveTokens(tokens, tokens->count + from->count);
+    memcpy(tokens->types + tokens->count, from->types, sizeof(uint8_t) * from->count);
+    memcpy(tokens->starts + tokens->count, from->starts, sizeof(int) * from->count);
+    memcpy(tokens->lengths + tokens->count, from->lengths, sizeof(int) * from->count);
+    for (int i = 0; i < from->count; ++i)
+    {
+        tokens->lines[tokens->count + i] = from->lines[i] + lineDelta;
+    }
+    tokens->count += from->count;
+}
+
+int tokenizeThreads(int length)
+{
+#ifdef NO_THREADS
+    (void)length;
+    return 1;
+#else
+    long threads = length / TOKENIZE_CHUNK_MIN;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > cpus) threads = cpus;
+    if (threads > TOKENIZE_THREADS_MAX) threads = TOKENIZE_THREADS_MAX;
+    return threads < 1 ? 1 : (int)threads;
+#endif
+}
+
+void tokenizeSource(TokenArray* tokens, const char* source, const char* end)
+{
+    int length = (int)(end - source);
+    int pieceCount = tokenizeThreads(length);
+
+    Piece pieces[TOKENIZE_THREADS_MAX];
+    for (int i = 0; i < pieceCount; ++i)
+    {
+        Piece* piece = &pieces[i];
+        piece->source = source;
+        piece->end = end;
+        piece->line = 1;
+        piece->limit = INT_MAX;
+
+        // Pieces start on a line, which puts them outside any comment.
+        // A start inside a multi-line string is caught when merging.
+        piece->begin = 0;
+        if (i > 0)
+        {
+            int begin = (int)((int64_t)length * i / pieceCount);
+            const char* newline = (const char*)memchr(source + begin, '\n', length - begin);
+            begin = newline == NULL ? length : (int)(newline + 1 - source);
+            if (begin < pieces[i - 1].begin) begin = pieces[i - 1].begin;
+            piece->begin = begin;
+            pieces[i - 1].limit = begin;
+        }
+    }
+
+#ifndef NO_THREADS
+    pthread_t threads[TOKENIZE_THREADS_MAX];
+    bool started[TOKENIZE_THREADS_MAX] = {false};
+    for (int i = 1; i < pieceCount; ++i)
+    {
+        started[i] = pthread_create(&threads[i], NULL, scanPiece, &pieces[i]) == 0;
+    }
+    scanPiece(&pieces[0]);
+    for (int i = 1; i < pieceCount; ++i)
+    {
+        if (started[i]) pthread_join(threads[i], NULL);
+        else scanPiece(&pieces[i]);
+    }
+#else
+    for (int i = 0; i < pieceCount; ++i) scanPiece(&pieces[i]);
+#endif
+
+    // Lines in later pieces count from their own start, and are shifted
+    // once the line their first token is on is known.
+    freeTokenArray(tokens);
+    *tokens = pieces[0].tokens;
+    int stopStart = pieces[0].stopStart;
+    int stopLine = pieces[0].stopLine;
+    int merged = 1;
+    for (; merged < pieceCount; ++merged)
+    {
+        Piece* piece = &pieces[merged];
+        // A token that ran over the boundary desynchronized this piece.
+        if (piece->firstStart != stopStart) break;
+
+        int lineDelta = stopLine - piece->firstLine;
+        appendPiece(tokens, piece, lineDelta);
+        stopStart = piece->stopStart;
+        stopLine = piece->stopLine + lineDelta;
+        freeTokenArray(&piece->tokens);
+    }
+
+    if (merged < pieceCount)
+    {
+        // Rescan the rest from the first token not yet taken.
+        Piece rest = pieces[pieceCount - 1];
+        rest.begin = stopStart;
+        rest.line = stopLine;
+        rest.limit = INT_MAX;
+        scanPiece(&rest);
+        appendPiece(tokens, &rest, 0);
+        freeTokenArray(&rest.tokens);
+
+        for (; merged < pieceCount; ++merged) freeTokenArray(&pieces[merged].tokens);
+    }
+}
+
+Token tokenAt(const TokenArray* tokens, int index)
+{
+    if (index >= tokens->count) index = tokens->count - 1;
+
+    Token token;
+    token.type = (TokenType)tokens->types[index];
+    token.start = tokens->source + tokens->starts[index];
+    token.length = tokens->lengths[index];
+    token.line = tokens->lines[index];
+
+    if (token.type == TOKEN_ERROR)
+    {
+        Scanner scanner;
+        initScanner(&scanner, token.start, tokens->end);
+        token.start = scanToken(&scanner).start;
+    }
+    return token;
+}
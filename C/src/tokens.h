@@ -0,0 +1,33 @@
+#ifndef clox_tokens_h
+#define clox_tokens_h
+
+#include "common.h"
+#include "scanner.h"
+
+// A whole source scanned ahead of the parser, one array per field so the
+// parser walks them in order. Starts are offsets into source. Error tokens
+// keep the offset of the bad text, and tokenAt() scans them again for
+// their message.
+typedef struct {
+    const char* source;
+    const char* end;
+
+    int count;
+    int capacity;
+    uint8_t* types;
+    int* starts;
+    int* lengths;
+    int* lines;
+} TokenArray;
+
+void initTokenArray(TokenArray* tokens, const char* source, const char* end);
+void freeTokenArray(TokenArray* tokens);
+// How many threads tokenizeSource() would use for length bytes.
+int tokenizeThreads(int length);
+// Scans [source, end) up to and including its EOF token. Large sources are
+// split at line starts and the pieces scanned on separate threads.
+void tokenizeSource(TokenArray* tokens, const char* source, const char* end);
+// Past the end, the EOF token repeats like it does from scanToken().
+Token tokenAt(const TokenArray* tokens, int index);
+
+#endif
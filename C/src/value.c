@@ -4,8 +4,45 @@
 
 #include <stdio.h>
 
+Value smallStringValue(const char* chars, int length)
+{
+    uint64_t bits = 0;
+    for (int i = 0; i < length; ++i) bits |= (uint64_t)(uint8_t)chars[i] << (8 * i);
+    return SMALL_STRING_VAL(bits);
+}
+
+int smallStringLength(Value value)
+{
+    // Strings never contain a zero byte, so the length is the position of
+    // the highest nonzero byte.
+    uint64_t bits = AS_SMALL_STRING(value);
+    int length = 0;
+    while (bits != 0)
+    {
+        bits >>= 8;
+        length++;
+    }
+    return length;
+}
+
+int smallStringChars(Value value, char* chars)
+{
+    uint64_t bits = AS_SMALL_STRING(value);
+    int length = 0;
+    for (; bits != 0; bits >>= 8) chars[length++] = (char)(bits & 0xff);
+    return length;
+}
+
 bool valuesEqual(Value a, Value b)
 {
+#ifdef NAN_BOXING
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+    {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    if (a == b) return !IS_NATIVE_ERROR(a);
+    return IS_OBJ(a) && IS_OBJ(b) && (IS_ROPE(a) || IS_ROPE(b)) && ropesEqual(a, b);
+#else
     if (a.type != b.type) return false;
 
     switch (a.type)
@@ -16,11 +53,15 @@ bool valuesEqual(Value a, Value b)
             return true;
         case VAL_NUMBER:
             return AS_NUMBER(a) == AS_NUMBER(b);
+        case VAL_SMALL_STRING:
+            return AS_SMALL_STRING(a) == AS_SMALL_STRING(b);
         case VAL_OBJ:
-            return AS_OBJ(a) == AS_OBJ(b);
+            if (AS_OBJ(a) == AS_OBJ(b)) return true;
+            return (IS_ROPE(a) || IS_ROPE(b)) && ropesEqual(a, b);
         default:
             return false;
     }
+#endif
 }
 
 void initValueArray(ValueArray* array)
@@ -51,22 +92,28 @@ void freeValueArray(ValueArray* array)
 
 }
 
-void printValue(Value value)
+void printValue(FILE* file, Value value)
 {
-    switch (value.type)
+    if (IS_NUMBER(value))
     {
-        case VAL_NUMBER:
-            printf("%g", AS_NUMBER(value));
-            break;
-        case VAL_NIL:
-            printf("nil");
-            break;
-        case VAL_BOOL:
-            printf(AS_BOOL(value) ? "true" : "false");
-            break;
-        case VAL_OBJ: printObject(AS_OBJ(value)); break;
-        default:
-            return;
-
+        fprintf(file, "%g", AS_NUMBER(value));
+    }
+    else if (IS_NIL(value))
+    {
+        fprintf(file, "nil");
+    }
+    else if (IS_BOOL(value))
+    {
+        fprintf(file, AS_BOOL(value) ? "true" : "false");
+    }
+    else if (IS_SMALL_STRING(value))
+    {
+        char chars[SMALL_STRING_MAX];
+        int length = smallStringChars(value, chars);
+        fprintf(file, "%.*s", length, chars);
+    }
+    else if (IS_OBJ(value))
+    {
+        printObject(file, AS_OBJ(value));
     }
 }
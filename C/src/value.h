@@ -4,15 +4,88 @@
 
 #include "common.h"
 
+#include <stdio.h>
+
 typedef struct sObj Obj;
 typedef struct sObjString ObjString;
 
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+// Numbers are stored as plain doubles. Every other value is a quiet NaN:
+// the low bits of QNAN carry nil/false/true, and with SIGN_BIT set the
+// low 48 bits carry an object pointer. UNDEFINED_VAL marks global slots
+// that have been reserved by the compiler but not defined yet. TAG_NATIVE_ERROR is a spare
+// mantissa bit that separates native error markers from ordinary objects.
+// Without SIGN_BIT, TAG_SMALL_STRING marks a small string in the low 48 bits.
+#define SIGN_BIT         ((uint64_t)0x8000000000000000)
+#define QNAN             ((uint64_t)0x7ffc000000000000)
+#define TAG_NATIVE_ERROR ((uint64_t)0x0001000000000000)
+#define TAG_SMALL_STRING ((uint64_t)0x0002000000000000)
+
+#define TAG_NIL   1
+#define TAG_FALSE 2
+#define TAG_TRUE  3
+#define TAG_UNDEFINED 4
+
+typedef uint64_t Value;
+
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL  ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+#define IS_BOOL(value)         (((value) | 1) == TRUE_VAL)
+#define IS_NUMBER(value)       (((value) & QNAN) != QNAN)
+#define IS_NIL(value)          ((value) == NIL_VAL)
+#define IS_UNDEFINED(value)    ((value) == UNDEFINED_VAL)
+#define IS_OBJ(value) \
+    (((value) & (SIGN_BIT | QNAN | TAG_NATIVE_ERROR)) == (SIGN_BIT | QNAN))
+#define IS_NATIVE_ERROR(value) \
+    (((value) & (SIGN_BIT | QNAN | TAG_NATIVE_ERROR)) == (SIGN_BIT | QNAN | TAG_NATIVE_ERROR))
+#define IS_SMALL_STRING(value) \
+    (((value) & (SIGN_BIT | QNAN | TAG_SMALL_STRING)) == (QNAN | TAG_SMALL_STRING))
+
+#define SMALL_STRING_MAX 6
+
+#define BOOL_VAL(b)             ((b) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL                 ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL           ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(num)         numToValue(num)
+#define OBJ_VAL(object)         (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object))
+#define NATIVE_ERROR_VAL(object) \
+    (Value)(SIGN_BIT | QNAN | TAG_NATIVE_ERROR | (uint64_t)(uintptr_t)(object))
+#define SMALL_STRING_VAL(bits)  ((Value)(QNAN | TAG_SMALL_STRING | (bits)))
+
+#define AS_BOOL(value)   ((value) == TRUE_VAL)
+#define AS_NUMBER(value) valueToNum(value)
+#define AS_OBJ(value) \
+    ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN | TAG_NATIVE_ERROR)))
+#define AS_SMALL_STRING(value) ((value) & ~(QNAN | TAG_SMALL_STRING))
+
+static inline double valueToNum(Value value)
+{
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+static inline Value numToValue(double num)
+{
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
+
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJ,
     VAL_NATIVE_ERROR,
+    VAL_UNDEFINED,
+    VAL_SMALL_STRING,
 } ValueType;
 
 typedef struct {
@@ -21,38 +94,55 @@ typedef struct {
         bool boolean;
         double number;
         Obj* obj;
+        uint64_t smallString;
     } as;
 } Value;
 
-typedef struct {
-    int capacity;
-    int count;
-    Value* values;
-} ValueArray;
-
-
-
 #define IS_BOOL(value)      ((value).type == VAL_BOOL)
 #define IS_NUMBER(value)    ((value).type == VAL_NUMBER)
 #define IS_NIL(value)       ((value).type == VAL_NIL)
 #define IS_OBJ(value)       ((value).type == VAL_OBJ)
 #define IS_NATIVE_ERROR(value)       ((value).type == VAL_NATIVE_ERROR)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
+#define IS_SMALL_STRING(value) ((value).type == VAL_SMALL_STRING)
+
+#define SMALL_STRING_MAX 8
 
 #define BOOL_VAL(value)     ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL             ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value)   ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)      ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 #define NATIVE_ERROR_VAL(object) ((Value){VAL_NATIVE_ERROR, {.obj = (Obj*)object}})
+#define UNDEFINED_VAL       ((Value){VAL_UNDEFINED, {.number = 0}})
+#define SMALL_STRING_VAL(bits) ((Value){VAL_SMALL_STRING, {.smallString = bits}})
 
 #define AS_BOOL(value)   ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
 #define AS_OBJ(value)    ((value).as.obj)
+#define AS_SMALL_STRING(value) ((value).as.smallString)
+
+#endif
+
+typedef struct {
+    int capacity;
+    int count;
+    Value* values;
+} ValueArray;
+
 
+// Strings of up to SMALL_STRING_MAX characters live in the value itself,
+// character i in bits 8i to 8i + 7 and zeros above, and are never
+// allocated or interned. A longer string is never stored this way, so two
+// small strings are equal exactly when their bits are.
+Value smallStringValue(const char* chars, int length);
+int smallStringLength(Value value);
+// Copies out the characters and returns their count. No terminator.
+int smallStringChars(Value value, char* chars);
 
 bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
 
-void printValue(Value value);
+void printValue(FILE* file, Value value);
 #endif
@@ -1,11 +1,14 @@
+#include "cache.h"
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "module.h"
 #include "object.h"
+#include "registers.h"
 #include "vm.h"
 #include "value.h"
 
-#ifdef DEBUG_TRACE_EXECUTION
+#if defined(DEBUG_TRACE_EXECUTION) || defined(DEBUG_PROFILE_OPCODES)
 #include "debug.h"
 #endif
 
@@ -14,8 +17,76 @@
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+
+// Stands in for a context argument threaded through every call. Each
+// entry point makes its VM current on the calling thread for as long as it
+// runs, so VMs on different threads never see each other. See
+// test/parallel_vms.c.
+THREAD_LOCAL VM* vm = NULL;
+
+#ifdef DEBUG_PROFILE_OPCODES
+#define PROFILE_TOP 20
+
+static THREAD_LOCAL uint64_t opcodePairs[OP_COUNT][OP_COUNT];
+static THREAD_LOCAL uint64_t opcodeTriples[OP_COUNT][OP_COUNT][OP_COUNT];
+static THREAD_LOCAL int previousOpcodes[2] = {-1, -1};
+
+static void profileInstruction(uint8_t instruction)
+{
+    if (previousOpcodes[1] != -1)
+    {
+        opcodePairs[previousOpcodes[1]][instruction]++;
+        if (previousOpcodes[0] != -1)
+        {
+            opcodeTriples[previousOpcodes[0]][previousOpcodes[1]][instruction]++;
+        }
+    }
+    previousOpcodes[0] = previousOpcodes[1];
+    previousOpcodes[1] = instruction;
+}
+
+static void printProfile(const char* title, uint64_t* counts, int length, int arity)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < length; ++i) total += counts[i];
+    if (total == 0) return;
+
+    fprintf(stderr, "== most frequent opcode %s ==\n", title);
+    for (int rank = 0; rank < PROFILE_TOP; ++rank)
+    {
+        int best = -1;
+        for (int i = 0; i < length; ++i)
+        {
+            if (counts[i] > 0 && (best == -1 || counts[i] > counts[best])) best = i;
+        }
+        if (best == -1) break;
+
+        fprintf(stderr, "%12llu %5.2f%% ", (unsigned long long)counts[best], 100.0 * counts[best] / total);
+        int index = best;
+        int divisor = arity == 3 ? OP_COUNT * OP_COUNT : OP_COUNT;
+        for (int i = 0; i < arity; ++i)
+        {
+            fprintf(stderr, " %s", opcodeName((uint8_t)(index / divisor)));
+            index %= divisor;
+            divisor /= OP_COUNT;
+        }
+        fprintf(stderr, "\n");
+        // Printed entries are cleared so the next pass finds the runner-up.
+        counts[best] = 0;
+    }
+}
+
+#define PROFILE_INSTRUCTION() profileInstruction(instruction)
+#else
+#define PROFILE_INSTRUCTION() do { } while (false)
+#endif
 
-VM vm;
+#ifdef COUNT_INSTRUCTIONS
+#define COUNT_INSTRUCTION() (vm->instructionCount++)
+#else
+#define COUNT_INSTRUCTION() do { } while (false)
+#endif
 
 static Value clockNative(int argCount, Value* args)
 {
@@ -24,8 +95,61 @@ static Value clockNative(int argCount, Value* args)
 
 static void resetStack()
 {
-    vm.stackTop = vm.stack;
-    vm.frameCount = 0;
+    vm->stackTop = vm->stack;
+    vm->frameCount = 0;
+}
+
+// The function whose inlined body holds the instruction at fault, or NULL.
+// A body runs from where OP_INLINE_CALL jumps to the target of the jump
+// after the fallback call.
+static ObjFunction* inlinedAt(Chunk* chunk, int fault)
+{
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk->code[offset]))
+    {
+        if (chunk->code[offset] != OP_INLINE_CALL) continue;
+
+        int call = offset + instructionLength(OP_INLINE_CALL);
+        int jump = call + instructionLength(chunk->code[call]);
+        if (jump >= chunk->count || chunk->code[jump] != OP_JUMP) continue;
+
+        int end = jumpTarget(chunk, jump);
+        for (int at = jumpTarget(chunk, offset); at < end && jumpTarget(chunk, at) == -1;
+             at += instructionLength(chunk->code[at]))
+        {
+            if (fault >= at && fault < at + instructionLength(chunk->code[at]))
+            {
+                return AS_FUNCTION(chunk->constants.values[chunk->code[offset + 2]]);
+            }
+        }
+    }
+    return NULL;
+}
+
+static ObjFunction* registerInlinedAt(ObjFunction* function, int fault)
+{
+    RegisterChunk* chunk = &function->registerChunk;
+    for (int offset = 0; offset < chunk->count; offset += registerInstructionLength(REGISTER_OP(chunk->code[offset])))
+    {
+        RegisterInstruction instruction = chunk->code[offset];
+        if (REGISTER_OP(instruction) != ROP_INLINE_CALL) continue;
+
+        int call = offset + registerInstructionLength(ROP_INLINE_CALL);
+        int jump = call + registerInstructionLength(REGISTER_OP(chunk->code[call]));
+        if (jump >= chunk->count || REGISTER_OP(chunk->code[jump]) != ROP_JUMP) continue;
+
+        int end = (int)chunk->code[jump + 1];
+        for (int at = (int)chunk->code[offset + 1]; at < end; at += registerInstructionLength(REGISTER_OP(chunk->code[at])))
+        {
+            RegisterFormat format = registerFormat(REGISTER_OP(chunk->code[at]));
+            if (format == FORMAT_JUMP || format == FORMAT_TEST || format == FORMAT_COMPARE_JUMP ||
+                format == FORMAT_COMPARE_K_JUMP) break;
+            if (fault >= at && fault < at + registerInstructionLength(REGISTER_OP(chunk->code[at])))
+            {
+                return AS_FUNCTION(function->chunk.constants.values[REGISTER_C(instruction)]);
+            }
+        }
+    }
+    return NULL;
 }
 
 static void runtimeError(const char* format, ...)
@@ -36,13 +160,31 @@ static void runtimeError(const char* format, ...)
     va_end(args);
     fputs("\n", stderr);
 
-    for (int i = vm.frameCount - 1; i >= 0; --i)
+    for (int i = vm->frameCount - 1; i >= 0; --i)
     {
-        CallFrame* frame = &vm.frames[i];
+        CallFrame* frame = &vm->frames[i];
         ObjFunction* function = frame->function;
 
-        size_t instruction = frame->ip - function->chunk.code - 1;
-        int line = getLine(&frame->function->chunk.lines, instruction).line;
+        int line;
+        ObjFunction* inlined = NULL;
+        if (vm->backend == BACKEND_REGISTER)
+        {
+            size_t instruction = frame->registerIp - function->registerChunk.code - 1;
+            line = getLine(&function->registerChunk.lines, instruction);
+            inlined = registerInlinedAt(function, (int)instruction);
+        }
+        else
+        {
+            size_t instruction = frame->ip - function->chunk.code - 1;
+            line = getLine(&function->chunk.lines, instruction);
+            inlined = inlinedAt(&function->chunk, (int)instruction);
+        }
+        // An inlined body has no frame of its own, so it is listed as if
+        // it had been called.
+        if (inlined != NULL)
+        {
+            fprintf(stderr, "[line %d] in %s()\n", getLine(&inlined->chunk.lines, 0), inlined->name->chars);
+        }
         fprintf(stderr, "[line %d] in ", line);
 
         if (function->name == NULL)
@@ -53,6 +195,11 @@ static void runtimeError(const char* format, ...)
         {
             fprintf(stderr, "%s()\n", function->name->chars);
         }
+        if (frame->tailCalls > 0)
+        {
+            fprintf(stderr, "... %llu frame%s elided by tail calls\n", (unsigned long long)frame->tailCalls,
+                frame->tailCalls == 1 ? "" : "s");
+        }
     }
 
     resetStack();
@@ -60,50 +207,217 @@ static void runtimeError(const char* format, ...)
 
 static Value peek(int distance)
 {
-    return vm.stackTop[-1 - distance];
+    return vm->stackTop[-1 - distance];
 }
 
 static void defineNative(const char* name, NativeFn function, int arity)
 {
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
     push(OBJ_VAL(newNative(function, arity)));
-    tableSet(&vm.globals, AS_STRING(peek(1)), peek(0));
+    int slot = globalSlot(AS_STRING(peek(1)));
+    vm->modules[vm->module]->values.values[slot] = peek(0);
+    vm->nativeCount = slot + 1;
     pop();
     pop();
 }
 
-void initVM()
+static uint64_t randomSeed()
+{
+    // Address space layout randomization makes stack and code addresses
+    // differ between runs too.
+    uint64_t seed = (uint64_t)time(NULL);
+    seed = seed * 0x9e3779b97f4a7c15ull ^ (uint64_t)clock();
+    seed = seed * 0x9e3779b97f4a7c15ull ^ (uint64_t)getpid();
+    seed = seed * 0x9e3779b97f4a7c15ull ^ (uint64_t)(uintptr_t)&seed;
+    seed = seed * 0x9e3779b97f4a7c15ull ^ (uint64_t)(uintptr_t)&randomSeed;
+    return seed;
+}
+
+VM* newVM()
 {
+    VM* instance = (VM*)malloc(sizeof(VM));
+    if (instance == NULL) exit(1);
+    VM* enclosing = vm;
+    vm = instance;
+
     resetStack();
-    initTable(&vm.strings);
-    initTable(&vm.globals);
-    vm.objects = NULL;
+    vm->hashSeed = randomSeed();
+    initTable(&vm->strings);
+    vm->modules = NULL;
+    vm->moduleCount = 0;
+    vm->moduleCapacity = 0;
+    initTable(&vm->modulePaths);
+    vm->nativeCount = 0;
+    vm->objects = NULL;
 
+    vm->backend = BACKEND_STACK;
+#ifdef COUNT_INSTRUCTIONS
+    vm->instructionCount = 0;
+#endif
+    vm->output = stdout;
+
+    vm->bytesAllocated = 0;
+    vm->nextGC = 1024 * 1024;
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
+
+    vm->gcCount = 0;
+    vm->gcPauseTotal = 0;
+    vm->gcPauseMax = 0;
+
+    vm->module = 0;
+    newModule(NULL);
     defineNative("clock", clockNative, 0);
+
+    vm = enclosing;
+    return instance;
 }
 
-void freeVM()
+void freeVM(VM* instance)
 {
-    freeTable(&vm.strings);
+    VM* enclosing = vm == instance ? NULL : vm;
+    vm = instance;
+
+#ifdef DEBUG_PROFILE_OPCODES
+    printProfile("pairs", &opcodePairs[0][0], OP_COUNT * OP_COUNT, 2);
+    printProfile("triples", &opcodeTriples[0][0][0], OP_COUNT * OP_COUNT * OP_COUNT, 3);
+#endif
+
+    freeTable(&vm->strings);
+    for (int i = 0; i < vm->moduleCount; ++i)
+    {
+        Module* module = vm->modules[i];
+        freeTable(&module->slots);
+        freeValueArray(&module->values);
+        freeValueArray(&module->names);
+        FREE_ARRAY(int, module->imports, module->importCapacity);
+        FREE(Module, module);
+    }
+    FREE_ARRAY(Module*, vm->modules, vm->moduleCapacity);
+    freeTable(&vm->modulePaths);
     freeObjects();
+
+    vm = enclosing;
+    free(instance);
 }
 
 void push(Value value)
 {
-    if (vm.stackTop == vm.stack + STACK_MAX - 1)
+    if (vm->stackTop == vm->stack + STACK_MAX - 1)
     {
         runtimeError("FATAL: Stack overflow.");
         exit(42);
     }
-    *vm.stackTop = value;
-    ++vm.stackTop;
+    *vm->stackTop = value;
+    ++vm->stackTop;
 
 }
 
 Value pop()
 {
-    vm.stackTop--;
-    return *vm.stackTop;
+    vm->stackTop--;
+    return *vm->stackTop;
+}
+
+int newModule(ObjString* path)
+{
+    // Every allocation here can trigger a collection, which only sees the
+    // module once it is in the array.
+    if (path != NULL) push(OBJ_VAL(path));
+    if (vm->moduleCapacity < vm->moduleCount + 1)
+    {
+        int oldCapacity = vm->moduleCapacity;
+        vm->moduleCapacity = GROW_CAPACITY(oldCapacity);
+        vm->modules = GROW_ARRAY(Module*, vm->modules, oldCapacity, vm->moduleCapacity);
+    }
+
+    Module* module = ALLOCATE(Module, 1);
+    module->path = path;
+    initTable(&module->slots);
+    initValueArray(&module->values);
+    initValueArray(&module->names);
+    module->imports = NULL;
+    module->importCount = 0;
+    module->importCapacity = 0;
+    module->function = NULL;
+
+    int index = vm->moduleCount++;
+    vm->modules[index] = module;
+    if (path != NULL) tableSet(&vm->modulePaths, path, NUMBER_VAL(index));
+
+    int enclosing = vm->module;
+    vm->module = index;
+    for (int i = 0; i < vm->nativeCount; ++i)
+    {
+        int slot = globalSlot(AS_STRING(vm->modules[0]->names.values[i]));
+        module->values.values[slot] = vm->modules[0]->values.values[i];
+    }
+    vm->module = enclosing;
+
+    if (path != NULL) pop();
+    return index;
+}
+
+static bool importsModule(Module* module, int imported)
+{
+    for (int i = 0; i < module->importCount; ++i)
+    {
+        if (module->imports[i] == imported) return true;
+    }
+    return false;
+}
+
+void addImport(int index, int imported)
+{
+    Module* module = vm->modules[index];
+    if (importsModule(module, imported)) return;
+    if (module->importCapacity < module->importCount + 1)
+    {
+        int oldCapacity = module->importCapacity;
+        module->importCapacity = GROW_CAPACITY(oldCapacity);
+        module->imports = GROW_ARRAY(int, module->imports, oldCapacity, module->importCapacity);
+    }
+    module->imports[module->importCount++] = imported;
+}
+
+int globalSlot(ObjString* name)
+{
+    Module* module = vm->modules[vm->module];
+    Value slot;
+    if (tableGet(&module->slots, name, &slot)) return (int)AS_NUMBER(slot);
+
+    push(OBJ_VAL(name));
+    int index = module->values.count;
+    writeValueArray(&module->values, UNDEFINED_VAL);
+    writeValueArray(&module->names, OBJ_VAL(name));
+    tableSet(&module->slots, name, NUMBER_VAL(index));
+    pop();
+    return index;
+}
+
+// Fills the globals that the module at index uses, but has not defined,
+// from the modules it imports. The first import that defines a name wins.
+static void bindImports(int index)
+{
+    Module* module = vm->modules[index];
+    for (int slot = vm->nativeCount; slot < module->values.count; ++slot)
+    {
+        if (!IS_UNDEFINED(module->values.values[slot])) continue;
+
+        ObjString* name = AS_STRING(module->names.values[slot]);
+        for (int i = 0; i < module->importCount; ++i)
+        {
+            Module* imported = vm->modules[module->imports[i]];
+            Value importedSlot;
+            if (!tableGet(&imported->slots, name, &importedSlot)) continue;
+
+            Value value = imported->values.values[(int)AS_NUMBER(importedSlot)];
+            if (IS_UNDEFINED(value)) continue;
+            module->values.values[slot] = value;
+            break;
+        }
+    }
 }
 
 
@@ -115,16 +429,35 @@ static bool isFalsey(Value value)
 
 static void concatenate()
 {
-    ObjString* b = AS_STRING(pop());
-    ObjString* a = AS_STRING(pop());
+    Value string = concatenateValues(peek(1), peek(0));
 
-    ObjString* string = concatenateStrings(a, b);
+    pop();
+    pop();
+    push(string);
 
-    push(OBJ_VAL(string));
+}
 
+// Adds the two values on top of the stack, replacing them with the sum.
+static bool add()
+{
+    if (IS_ANY_STRING(peek(0)) && IS_ANY_STRING(peek(1)))
+    {
+        concatenate();
+    }
+    else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+    {
+        double b = AS_NUMBER(pop());
+        double a = AS_NUMBER(pop());
+        push(NUMBER_VAL(a + b));
+    }
+    else
+    {
+        return false;
+    }
+    return true;
 }
 
-static bool call(ObjFunction* function, uint8_t argCount)
+static bool call(ObjFunction* function, int argCount, Value* slots)
 {
     if (argCount != function->arity)
     {
@@ -132,17 +465,40 @@ static bool call(ObjFunction* function, uint8_t argCount)
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX)
+    if (vm->frameCount == FRAMES_MAX)
     {
         runtimeError("Stack overflow.");
         return false;
     }
-    CallFrame* frame = &vm.frames[vm.frameCount++];
+    CallFrame* frame = &vm->frames[vm->frameCount++];
 
     frame->function = function;
     frame->ip = function->chunk.code;
 
-    frame->slots = vm.stackTop - argCount - 1;
+    frame->slots = slots;
+    frame->globals = vm->modules[function->module]->values.values;
+    frame->constants = function->chunk.constants.values;
+    frame->tailCalls = 0;
+    return true;
+}
+
+// Calls a native on the arguments in args and stores the result in the
+// callee's slot just below them.
+static bool callNative(ObjNative* native, int argCount, Value* args)
+{
+    if (argCount != native->arity)
+    {
+        runtimeError("Expect %d arguments but %d were given\n", native->arity, argCount);
+        return false;
+    }
+    Value result = native->function(argCount, args);
+
+    if (IS_NATIVE_ERROR(result))
+    {
+        runtimeError(AS_CSTRING(result));
+        return false;
+    }
+    args[-1] = result;
     return true;
 }
 
@@ -153,26 +509,11 @@ static bool callValue(Value callee, int argCount)
         switch (OBJ_TYPE(callee))
         {
             case OBJ_FUNCTION:
-                return call(AS_FUNCTION(callee), argCount);
-            case OBJ_NATIVE: {
-                int arity = ((ObjNative*)AS_OBJ(callee))->arity;
-                NativeFn native = AS_NATIVE(callee);
-                if (argCount != arity)
-                {
-                    runtimeError("Expect %d arguments but %d were given\n", arity, argCount);
-                    return false;
-                }
-                Value result = native(argCount, vm.stackTop - argCount);
-
-                if (IS_NATIVE_ERROR(result))
-                {
-                    runtimeError(AS_CSTRING(result));
-                    return false;
-                }
-                vm.stackTop -= argCount + 1;
-                push(result);
+                return call(AS_FUNCTION(callee), argCount, vm->stackTop - argCount - 1);
+            case OBJ_NATIVE:
+                if (!callNative((ObjNative*)AS_OBJ(callee), argCount, vm->stackTop - argCount)) return false;
+                vm->stackTop -= argCount;
                 return true;
-            }
             case OBJ_STRING:
             default:
                 break;
@@ -185,18 +526,26 @@ static bool callValue(Value callee, int argCount)
 
 static InterpretResult run()
 {
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
 
     register uint8_t* instruction_pointer = frame->ip;
+    register Value* constants = frame->constants;
+    register Value* slots = frame->slots;
 
 #define READ_BYTE() (*instruction_pointer++)
-#define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
+#define READ_CONSTANT() (constants[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 #define READ_SHORT()\
     (instruction_pointer += 2, (uint16_t)((instruction_pointer[-2] << 8) | instruction_pointer[-1]))
+#define READ_LONG()\
+    (instruction_pointer += 3, \
+     (instruction_pointer[-3] << 16) | (instruction_pointer[-2] << 8) | instruction_pointer[-1])
+#define RESTORE_IP() frame->ip = instruction_pointer
+#define GLOBAL_NAME(slot) AS_STRING(vm->modules[frame->function->module]->names.values[slot])
 #define BINARY_OP(valueType, op) \
         do { \
             if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+                RESTORE_IP(); \
                 runtimeError("Operands must be numbers."); \
                 return INTERPRET_RUNTIME_ERROR; \
             } \
@@ -204,200 +553,858 @@ static InterpretResult run()
             double a = AS_NUMBER(pop()); \
             push(valueType(a op b)); \
         } while (false)
-#define RESTORE_IP() frame->ip = instruction_pointer
+#define ADD_OP() \
+        do { \
+            if (!add()) { \
+                RESTORE_IP(); \
+                runtimeError("Operants must be two numbers or two strings."); \
+                return INTERPRET_RUNTIME_ERROR; \
+            } \
+        } while (false)
 
+// Calls to Lox functions push their frame right here. Natives, errors and
+// stack overflow take the general path through callValue().
+#define CALL_OP(argCount) \
+        do { \
+            Value callee = peek(argCount); \
+            if (IS_FUNCTION(callee) && AS_FUNCTION(callee)->arity == (argCount) && \
+                vm->frameCount < FRAMES_MAX) \
+            { \
+                ObjFunction* function = AS_FUNCTION(callee); \
+                RESTORE_IP(); \
+                frame = &vm->frames[vm->frameCount++]; \
+                frame->function = function; \
+                slots = vm->stackTop - (argCount) - 1; \
+                frame->slots = slots; \
+                frame->globals = vm->modules[function->module]->values.values; \
+                frame->constants = function->chunk.constants.values; \
+                frame->tailCalls = 0; \
+                instruction_pointer = function->chunk.code; \
+                constants = frame->constants; \
+            } \
+            else \
+            { \
+                RESTORE_IP(); \
+                if (!callValue(callee, argCount)) return INTERPRET_RUNTIME_ERROR; \
+                frame = &vm->frames[vm->frameCount - 1]; \
+                instruction_pointer = frame->ip; \
+                constants = frame->constants; \
+                slots = frame->slots; \
+            } \
+        } while (false)
 
-    while (true)
-    {
-        // sleep(1);
-    #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stackTop; ++slot)
-        {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(&frame->function->chunk, (int)(instruction_pointer - frame->function->chunk.code));
-    #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE())
-        {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-            case OP_NEGATE   :
-                if (!IS_NUMBER(peek(0)))
-                {
-                    runtimeError("Operand must be a number.");
-                    RESTORE_IP();
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_ADD      : {
+// Rewrites the running instruction, whose operands were read already, so
+// it runs as op from now on.
+#ifdef QUICKENING
+#define QUICKEN(op, operands) (instruction_pointer[-1 - (operands)] = (op))
+#else
+#define QUICKEN(op, operands) do { } while (false)
+#endif
 
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
-                {
-                    concatenate();
-                }
-                else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
-                {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                }
-                else
-                {
-                    runtimeError("Operants must be two numbers or two strings.");
-                    RESTORE_IP();
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() \
+        do { \
+            printf("          "); \
+            for (Value* slot = vm->stack; slot < vm->stackTop; ++slot) \
+            { \
+                printf("[ "); \
+                printValue(stdout, *slot); \
+                printf(" ]"); \
+            } \
+            printf("\n"); \
+            disassembleInstruction(&frame->function->chunk, \
+                (int)(instruction_pointer - frame->function->chunk.code)); \
+        } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
+#endif
 
-                break; 
-            }
+#ifdef COMPUTED_GOTO
+    static void* dispatchTable[] = {
+#define OPCODE_LABEL(name, operands) &&label_##name,
+        OPCODE_LIST(OPCODE_LABEL)
+#undef OPCODE_LABEL
+    };
 
-            case OP_SUBSTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY : BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE   : BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NIL      : push(NIL_VAL); break;
-            case OP_TRUE     : push(BOOL_VAL(true)); break;
-            case OP_FALSE    : push(BOOL_VAL(false)); break;
-            case OP_NOT      : push(BOOL_VAL(isFalsey(pop()))); break;
-            case OP_GREATER  : BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS     : BINARY_OP(BOOL_VAL, <); break;
-            case OP_EQUAL    : {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(name) label_##name
+#define DISPATCH() \
+        do { \
+            TRACE_INSTRUCTION(); \
+            instruction = READ_BYTE(); \
+            PROFILE_INSTRUCTION(); \
+            COUNT_INSTRUCTION(); \
+            goto *dispatchTable[instruction]; \
+        } while (false)
+#else
+#define INTERPRET_LOOP \
+    loop: \
+        TRACE_INSTRUCTION(); \
+        instruction = READ_BYTE(); \
+        PROFILE_INSTRUCTION(); \
+        COUNT_INSTRUCTION(); \
+        switch (instruction)
+#define CASE(name) case name
+#define DISPATCH() goto loop
+#endif
+
+    uint8_t instruction;
+    INTERPRET_LOOP
+    {
+        CASE(OP_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            push(constant);
+            DISPATCH();
+        }
+        CASE(OP_CONSTANT_LONG): {
+            Value constant = constants[READ_LONG()];
+            push(constant);
+            DISPATCH();
+        }
+        CASE(OP_NEGATE):
+            if (!IS_NUMBER(peek(0)))
+            {
+                RESTORE_IP();
+                runtimeError("Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_POP      : pop(); break;
-            case OP_PRINT:
-                printValue(pop());
-                printf("\n");
-                break;
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
+            push(NUMBER_VAL(-AS_NUMBER(pop())));
+            DISPATCH();
+        CASE(OP_ADD):
+            ADD_OP();
+            QUICKEN(IS_NUMBER(peek(0)) ? OP_ADD_NUMBER : OP_ADD_STRING, 0);
+            DISPATCH();
+        CASE(OP_SUBSTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+        CASE(OP_MULTIPLY) : BINARY_OP(NUMBER_VAL, *); DISPATCH();
+        CASE(OP_DIVIDE)   : BINARY_OP(NUMBER_VAL, /); DISPATCH();
+        CASE(OP_NIL)      : push(NIL_VAL); DISPATCH();
+        CASE(OP_TRUE)     : push(BOOL_VAL(true)); DISPATCH();
+        CASE(OP_FALSE)    : push(BOOL_VAL(false)); DISPATCH();
+        CASE(OP_NOT)      : push(BOOL_VAL(isFalsey(pop()))); DISPATCH();
+        CASE(OP_GREATER)  : BINARY_OP(BOOL_VAL, >); DISPATCH();
+        CASE(OP_LESS)     : BINARY_OP(BOOL_VAL, <); DISPATCH();
+        CASE(OP_EQUAL)    : {
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_NOT_EQUAL): {
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(!valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_POP)      : pop(); DISPATCH();
+        CASE(OP_POPN)     : vm->stackTop -= READ_BYTE(); DISPATCH();
+        CASE(OP_PRINT):
+            printValue(vm->output, pop());
+            fputc('\n', vm->output);
+            DISPATCH();
+        CASE(OP_DEFINE_GLOBAL):
+        CASE(OP_DEFINE_GLOBAL_LONG): {
+            int slot = instruction == OP_DEFINE_GLOBAL ? READ_BYTE() : READ_LONG();
+            frame->globals[slot] = pop();
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL):
+        CASE(OP_SET_GLOBAL_LONG): {
+            int slot = instruction == OP_SET_GLOBAL ? READ_BYTE() : READ_LONG();
+            if (IS_UNDEFINED(frame->globals[slot])) {
+                RESTORE_IP();
+                runtimeError("Undefined global variable '%s'.", GLOBAL_NAME(slot)->chars);
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined global variable '%s'.", name->chars);
-                    RESTORE_IP();
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            frame->globals[slot] = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL):
+        CASE(OP_GET_GLOBAL_LONG): {
+            int slot = instruction == OP_GET_GLOBAL ? READ_BYTE() : READ_LONG();
+            Value value = frame->globals[slot];
+            if (IS_UNDEFINED(value)) {
+                RESTORE_IP();
+                runtimeError("Undefined global variable '%s'.", GLOBAL_NAME(slot)->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            push(value);
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            push(slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(peek(0))) instruction_pointer += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            instruction_pointer += offset;
+            DISPATCH();
+        }
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            instruction_pointer -= offset;
+            DISPATCH();
+        }
+        CASE(OP_CALL): {
+            int argCount = READ_BYTE();
+            CALL_OP(argCount);
+            DISPATCH();
+        }
+        CASE(OP_CALL_0): CALL_OP(0); DISPATCH();
+        CASE(OP_CALL_1): CALL_OP(1); DISPATCH();
+        CASE(OP_CALL_2): CALL_OP(2); DISPATCH();
+        CASE(OP_CALL_3): CALL_OP(3); DISPATCH();
+        CASE(OP_TAIL_CALL): {
+            int argCount = READ_BYTE();
+            Value callee = peek(argCount);
+            if (IS_FUNCTION(callee) && AS_FUNCTION(callee)->arity == argCount)
+            {
+                // The callee and its arguments move down over this frame's
+                // window, which the callee then runs in.
+                ObjFunction* function = AS_FUNCTION(callee);
+                memmove(slots, vm->stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+                vm->stackTop = slots + argCount + 1;
+                frame->function = function;
+                frame->globals = vm->modules[function->module]->values.values;
+                frame->constants = function->chunk.constants.values;
+                frame->tailCalls++;
+                instruction_pointer = function->chunk.code;
+                constants = frame->constants;
+                DISPATCH();
+            }
+            CALL_OP(argCount);
+            DISPATCH();
+        }
+        CASE(OP_INLINE_CALL): {
+            int argCount = READ_BYTE();
+            Value expected = READ_CONSTANT();
+            uint16_t offset = READ_SHORT();
+            Value* callee = vm->stackTop - argCount - 1;
+            if (IS_OBJ(*callee) && AS_OBJ(*callee) == AS_OBJ(expected))
+            {
+                // The arguments move down over the callee for the body.
+                for (int i = 0; i < argCount; ++i) callee[i] = callee[i + 1];
+                vm->stackTop--;
+                instruction_pointer += offset;
+            }
+            DISPATCH();
+        }
+        CASE(OP_PEEK): {
+            uint8_t distance = READ_BYTE();
+            push(peek(distance));
+            DISPATCH();
+        }
+        CASE(OP_POP_UNDER): {
+            uint8_t count = READ_BYTE();
+            Value result = pop();
+            vm->stackTop -= count;
+            push(result);
+            DISPATCH();
+        }
+        CASE(OP_RETURN): {
+            Value result = pop();
+            vm->frameCount--;
+
+            if (vm->frameCount == 0)
+            {
+                pop();
+                RESTORE_IP();
+                return INTERPRET_OK;
             }
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-                bool exists = tableGet(&vm.globals, name, &value);
-                if (!exists) {
-                    runtimeError("Undefined global variable '%s'.", name->chars);
-                    RESTORE_IP();
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                break;
 
+            // The result takes the callee's slot.
+            *slots = result;
+            vm->stackTop = slots + 1;
+
+            frame--;
+            instruction_pointer = frame->ip;
+            constants = frame->constants;
+            slots = frame->slots;
+            DISPATCH();
+        }
+        CASE(OP_ADD_LOCALS): {
+            Value a = slots[READ_BYTE()];
+            Value b = slots[READ_BYTE()];
+            push(a);
+            push(b);
+            ADD_OP();
+            if (IS_NUMBER(peek(0))) QUICKEN(OP_ADD_LOCALS_NUMBER, 2);
+            DISPATCH();
+        }
+        CASE(OP_ADD_LOCAL_CONSTANT): {
+            Value a = slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            if (IS_NUMBER(a) && IS_NUMBER(b))
+            {
+                push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                DISPATCH();
             }
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
+            push(a);
+            push(b);
+            ADD_OP();
+            DISPATCH();
+        }
+        CASE(OP_LESS_LOCAL_CONSTANT): {
+            Value a = slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            if (!IS_NUMBER(a) || !IS_NUMBER(b))
+            {
+                RESTORE_IP();
+                runtimeError("Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
+            push(BOOL_VAL(AS_NUMBER(a) < AS_NUMBER(b)));
+            DISPATCH();
+        }
+        CASE(OP_LESS_LOCAL_CONSTANT_JUMP):
+        CASE(OP_LESS_LOCAL_CONSTANT_JUMP_OR_POP): {
+            Value a = slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            uint16_t offset = READ_SHORT();
+            if (!IS_NUMBER(a) || !IS_NUMBER(b))
+            {
+                RESTORE_IP();
+                runtimeError("Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) instruction_pointer += offset;
-                break;
+            if (AS_NUMBER(a) < AS_NUMBER(b))
+            {
+                if (instruction == OP_LESS_LOCAL_CONSTANT_JUMP) push(BOOL_VAL(true));
             }
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
+            else
+            {
+                push(BOOL_VAL(false));
                 instruction_pointer += offset;
-                break;   
             }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                instruction_pointer -= offset;
-                break;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE_OR_POP): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(peek(0)))
+            {
+                instruction_pointer += offset;
+            }
+            else
+            {
+                pop();
+            }
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL_POP): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = pop();
+            DISPATCH();
+        }
+        CASE(OP_INCREMENT_LOCAL): {
+            Value* local = &slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            if (IS_NUMBER(*local) && IS_NUMBER(b))
+            {
+                *local = NUMBER_VAL(AS_NUMBER(*local) + AS_NUMBER(b));
+                DISPATCH();
+            }
+            push(*local);
+            push(b);
+            ADD_OP();
+            *local = pop();
+            DISPATCH();
+        }
+        // A quickened instruction that meets other types becomes a
+        // polymorphic one, so a site that sees both types settles instead of
+        // being rewritten on every run.
+        CASE(OP_ADD_NUMBER):
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1)))
+            {
+                QUICKEN(OP_ADD_POLYMORPHIC, 0);
+                ADD_OP();
+                DISPATCH();
             }
-            case OP_CALL: {
-                int argCount = READ_BYTE();
+            {
+                double b = AS_NUMBER(pop());
+                vm->stackTop[-1] = NUMBER_VAL(AS_NUMBER(vm->stackTop[-1]) + b);
+            }
+            DISPATCH();
+        CASE(OP_ADD_STRING):
+            if (!IS_ANY_STRING(peek(0)) || !IS_ANY_STRING(peek(1)))
+            {
+                QUICKEN(OP_ADD_POLYMORPHIC, 0);
+                ADD_OP();
+                DISPATCH();
+            }
+            concatenate();
+            DISPATCH();
+        CASE(OP_ADD_LOCALS_NUMBER): {
+            Value a = slots[READ_BYTE()];
+            Value b = slots[READ_BYTE()];
+            if (!IS_NUMBER(a) || !IS_NUMBER(b))
+            {
+                QUICKEN(OP_ADD_LOCALS_POLYMORPHIC, 2);
+                push(a);
+                push(b);
+                ADD_OP();
+                DISPATCH();
+            }
+            push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+            DISPATCH();
+        }
+        CASE(OP_ADD_POLYMORPHIC): ADD_OP(); DISPATCH();
+        CASE(OP_ADD_LOCALS_POLYMORPHIC): {
+            push(slots[READ_BYTE()]);
+            push(slots[READ_BYTE()]);
+            ADD_OP();
+            DISPATCH();
+        }
+#ifndef COMPUTED_GOTO
+        default:
+            printf("Unknown op code: [%u]\n", instruction);
+            DISPATCH();
+#endif
+    }
 
-                if (!callValue(peek(argCount), argCount)) {
-                    RESTORE_IP();
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+#undef READ_BYTE
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef READ_SHORT
+#undef READ_LONG
+#undef RESTORE_IP
+#undef GLOBAL_NAME
+#undef BINARY_OP
+#undef ADD_OP
+#undef CALL_OP
+#undef QUICKEN
+#undef TRACE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+}
+
+// Sets up the register window of the frame call() just pushed. Its
+// registers stay below stackTop while it runs, so they are GC roots.
+static bool enterRegisterFrame(int argCount)
+{
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    RegisterChunk* chunk = &frame->function->registerChunk;
+    Value* top = frame->slots + chunk->registerCount;
+
+    if (top > vm->stack + STACK_MAX)
+    {
+        vm->frameCount--;
+        runtimeError("Stack overflow.");
+        return false;
+    }
+
+    frame->registerIp = chunk->code;
+    frame->callerTop = vm->stackTop;
+
+    // Registers past the caller's stackTop were not traced and may still
+    // refer to objects that have been freed since.
+    Value* first = frame->slots + argCount + 1;
+    if (first < vm->stackTop) first = vm->stackTop;
+    for (Value* slot = first; slot < top; ++slot) *slot = NIL_VAL;
+
+    if (top > vm->stackTop) vm->stackTop = top;
+    return true;
+}
+
+// Hands the running frame to the function at base, whose arguments follow
+// it. Returns false, leaving the frame alone, when its registers do not fit.
+static bool tailCallRegisters(CallFrame* frame, Value* base, int argCount)
+{
+    ObjFunction* function = AS_FUNCTION(*base);
+    RegisterChunk* chunk = &function->registerChunk;
+    Value* top = frame->slots + chunk->registerCount;
+    if (top > vm->stack + STACK_MAX) return false;
+
+    memmove(frame->slots, base, sizeof(Value) * (argCount + 1));
+    frame->function = function;
+    frame->globals = vm->modules[function->module]->values.values;
+    frame->constants = function->chunk.constants.values;
+    frame->registerIp = chunk->code;
+    frame->tailCalls++;
+
+    // As in enterRegisterFrame(), but the registers below stackTop now
+    // hold whatever this frame left there, which is still traced.
+    Value* first = frame->slots + argCount + 1;
+    if (first < vm->stackTop) first = vm->stackTop;
+    for (Value* slot = first; slot < top; ++slot) *slot = NIL_VAL;
+
+    if (top > vm->stackTop) vm->stackTop = top;
+    return true;
+}
+
+static bool addValues(Value a, Value b, Value* result)
+{
+    if (IS_ANY_STRING(a) && IS_ANY_STRING(b))
+    {
+        *result = concatenateValues(a, b);
+    }
+    else if (IS_NUMBER(a) && IS_NUMBER(b))
+    {
+        *result = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+static InterpretResult runRegisters()
+{
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+
+    register RegisterInstruction* instruction_pointer = frame->registerIp;
+    register Value* registers = frame->slots;
+
+#define RESTORE_IP() frame->registerIp = instruction_pointer
+#define CONSTANTS() (frame->constants)
+#define RA() registers[REGISTER_A(instruction)]
+#define RB() registers[REGISTER_B(instruction)]
+#define RC() registers[REGISTER_C(instruction)]
+#define KC() CONSTANTS()[REGISTER_C(instruction)]
+#define READ_TARGET() (frame->function->registerChunk.code + *instruction_pointer++)
+#define GLOBAL_NAME(slot) AS_STRING(vm->modules[frame->function->module]->names.values[slot])
+#define NUMBER_OPERANDS(a, b) \
+        do { \
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+                RESTORE_IP(); \
+                runtimeError("Operands must be numbers."); \
+                return INTERPRET_RUNTIME_ERROR; \
+            } \
+        } while (false)
+#define BINARY_OP(valueType, op, right) \
+        do { \
+            Value a = RB(); \
+            Value b = right; \
+            NUMBER_OPERANDS(a, b); \
+            RA() = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+        } while (false)
+#define ADD_OP(right) \
+        do { \
+            if (!addValues(RB(), right, &RA())) { \
+                RESTORE_IP(); \
+                runtimeError("Operants must be two numbers or two strings."); \
+                return INTERPRET_RUNTIME_ERROR; \
+            } \
+        } while (false)
+#define JUMP_UNLESS(op, right) \
+        do { \
+            Value a = RB(); \
+            Value b = right; \
+            RegisterInstruction* target = READ_TARGET(); \
+            NUMBER_OPERANDS(a, b); \
+            if (!(AS_NUMBER(a) op AS_NUMBER(b))) instruction_pointer = target; \
+        } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() \
+        do { \
+            printf("          "); \
+            for (Value* slot = registers; slot < vm->stackTop; ++slot) \
+            { \
+                printf("[ "); \
+                printValue(stdout, *slot); \
+                printf(" ]"); \
+            } \
+            printf("\n"); \
+            disassembleRegisterInstruction(frame->function, \
+                (int)(instruction_pointer - frame->function->registerChunk.code)); \
+        } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    static void* dispatchTable[] = {
+#define OPCODE_LABEL(name, format) &&label_##name,
+        REGISTER_OPCODE_LIST(OPCODE_LABEL)
+#undef OPCODE_LABEL
+    };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(name) label_##name
+#define DISPATCH() \
+        do { \
+            TRACE_INSTRUCTION(); \
+            instruction = *instruction_pointer++; \
+            COUNT_INSTRUCTION(); \
+            goto *dispatchTable[REGISTER_OP(instruction)]; \
+        } while (false)
+#else
+#define INTERPRET_LOOP \
+    loop: \
+        TRACE_INSTRUCTION(); \
+        instruction = *instruction_pointer++; \
+        COUNT_INSTRUCTION(); \
+        switch (REGISTER_OP(instruction))
+#define CASE(name) case name
+#define DISPATCH() goto loop
+#endif
+
+    RegisterInstruction instruction;
+    INTERPRET_LOOP
+    {
+        CASE(ROP_MOVE) : RA() = RB(); DISPATCH();
+        CASE(ROP_LOADK): RA() = CONSTANTS()[REGISTER_BX(instruction)]; DISPATCH();
+        CASE(ROP_LOADK_LONG): RA() = CONSTANTS()[*instruction_pointer++]; DISPATCH();
+        CASE(ROP_NIL)  : RA() = NIL_VAL; DISPATCH();
+        CASE(ROP_TRUE) : RA() = BOOL_VAL(true); DISPATCH();
+        CASE(ROP_FALSE): RA() = BOOL_VAL(false); DISPATCH();
+        CASE(ROP_GET_GLOBAL):
+        CASE(ROP_GET_GLOBAL_LONG): {
+            int slot = REGISTER_OP(instruction) == ROP_GET_GLOBAL ? REGISTER_BX(instruction) : *instruction_pointer++;
+            Value value = frame->globals[slot];
+            if (IS_UNDEFINED(value))
+            {
                 RESTORE_IP();
-                frame = &vm.frames[vm.frameCount - 1];
-                instruction_pointer = frame->ip;
-                break;
+                runtimeError("Undefined global variable '%s'.", GLOBAL_NAME(slot)->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            RA() = value;
+            DISPATCH();
+        }
+        CASE(ROP_SET_GLOBAL):
+        CASE(ROP_SET_GLOBAL_LONG): {
+            int slot = REGISTER_OP(instruction) == ROP_SET_GLOBAL ? REGISTER_BX(instruction) : *instruction_pointer++;
+            if (IS_UNDEFINED(frame->globals[slot]))
+            {
+                RESTORE_IP();
+                runtimeError("Undefined global variable '%s'.", GLOBAL_NAME(slot)->chars);
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_RETURN   : {
-                Value result = pop();
-                vm.frameCount--;
+            frame->globals[slot] = RA();
+            DISPATCH();
+        }
+        CASE(ROP_DEFINE_GLOBAL):
+        CASE(ROP_DEFINE_GLOBAL_LONG): {
+            int slot = REGISTER_OP(instruction) == ROP_DEFINE_GLOBAL ? REGISTER_BX(instruction) : *instruction_pointer++;
+            frame->globals[slot] = RA();
+            DISPATCH();
+        }
+        CASE(ROP_ADD)       : ADD_OP(RC()); DISPATCH();
+        CASE(ROP_SUBSTRACT) : BINARY_OP(NUMBER_VAL, -, RC()); DISPATCH();
+        CASE(ROP_MULTIPLY)  : BINARY_OP(NUMBER_VAL, *, RC()); DISPATCH();
+        CASE(ROP_DIVIDE)    : BINARY_OP(NUMBER_VAL, /, RC()); DISPATCH();
+        CASE(ROP_GREATER)   : BINARY_OP(BOOL_VAL, >, RC()); DISPATCH();
+        CASE(ROP_LESS)      : BINARY_OP(BOOL_VAL, <, RC()); DISPATCH();
+        CASE(ROP_EQUAL)     : RA() = BOOL_VAL(valuesEqual(RB(), RC())); DISPATCH();
+        CASE(ROP_NOT_EQUAL) : RA() = BOOL_VAL(!valuesEqual(RB(), RC())); DISPATCH();
+        CASE(ROP_ADDK)      : ADD_OP(KC()); DISPATCH();
+        CASE(ROP_SUBSTRACTK): BINARY_OP(NUMBER_VAL, -, KC()); DISPATCH();
+        CASE(ROP_MULTIPLYK) : BINARY_OP(NUMBER_VAL, *, KC()); DISPATCH();
+        CASE(ROP_DIVIDEK)   : BINARY_OP(NUMBER_VAL, /, KC()); DISPATCH();
+        CASE(ROP_GREATERK)  : BINARY_OP(BOOL_VAL, >, KC()); DISPATCH();
+        CASE(ROP_LESSK)     : BINARY_OP(BOOL_VAL, <, KC()); DISPATCH();
+        CASE(ROP_EQUALK)    : RA() = BOOL_VAL(valuesEqual(RB(), KC())); DISPATCH();
+        CASE(ROP_NOT_EQUALK): RA() = BOOL_VAL(!valuesEqual(RB(), KC())); DISPATCH();
+        CASE(ROP_NEGATE):
+            if (!IS_NUMBER(RB()))
+            {
+                RESTORE_IP();
+                runtimeError("Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            RA() = NUMBER_VAL(-AS_NUMBER(RB()));
+            DISPATCH();
+        CASE(ROP_NOT): RA() = BOOL_VAL(isFalsey(RB())); DISPATCH();
+        CASE(ROP_PRINT):
+            printValue(vm->output, RA());
+            fputc('\n', vm->output);
+            DISPATCH();
+        CASE(ROP_JUMP):
+            instruction_pointer = frame->function->registerChunk.code + *instruction_pointer;
+            DISPATCH();
+        CASE(ROP_JUMP_IF_FALSE): {
+            RegisterInstruction* target = READ_TARGET();
+            if (isFalsey(RA())) instruction_pointer = target;
+            DISPATCH();
+        }
+        CASE(ROP_JUMP_IF_NOT_LESS)    : JUMP_UNLESS(<, RC()); DISPATCH();
+        CASE(ROP_JUMP_IF_NOT_GREATER) : JUMP_UNLESS(>, RC()); DISPATCH();
+        CASE(ROP_JUMP_IF_NOT_LESSK)   : JUMP_UNLESS(<, KC()); DISPATCH();
+        CASE(ROP_JUMP_IF_NOT_GREATERK): JUMP_UNLESS(>, KC()); DISPATCH();
+        CASE(ROP_INLINE_CALL): {
+            Value* base = &RA();
+            int argCount = REGISTER_B(instruction);
+            RegisterInstruction* body = READ_TARGET();
+            if (IS_OBJ(*base) && AS_OBJ(*base) == AS_OBJ(KC()))
+            {
+                for (int i = 0; i < argCount; ++i) base[i] = base[i + 1];
+                instruction_pointer = body;
+            }
+            DISPATCH();
+        }
+        CASE(ROP_TAIL_CALL):
+        CASE(ROP_CALL): {
+            Value* base = &RA();
+            int argCount = REGISTER_B(instruction);
+            Value callee = *base;
 
-                if (vm.frameCount == 0)
+            RESTORE_IP();
+            if (REGISTER_OP(instruction) == ROP_TAIL_CALL && IS_FUNCTION(callee) &&
+                AS_FUNCTION(callee)->arity == argCount && tailCallRegisters(frame, base, argCount))
+            {
+                instruction_pointer = frame->registerIp;
+                DISPATCH();
+            }
+            if (IS_FUNCTION(callee))
+            {
+                if (!call(AS_FUNCTION(callee), argCount, base) || !enterRegisterFrame(argCount))
                 {
-                    pop();
-                    RESTORE_IP();
-                    return INTERPRET_OK;
+                    return INTERPRET_RUNTIME_ERROR;
                 }
+                frame = &vm->frames[vm->frameCount - 1];
+                instruction_pointer = frame->registerIp;
+                registers = frame->slots;
+            }
+            else if (IS_NATIVE(callee))
+            {
+                if (!callNative((ObjNative*)AS_OBJ(callee), argCount, base + 1)) return INTERPRET_RUNTIME_ERROR;
+            }
+            else
+            {
+                runtimeError("Object is not callable.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        }
+        CASE(ROP_RETURN): {
+            Value result = RA();
+            vm->frameCount--;
+            vm->stackTop = frame->callerTop;
 
-                vm.stackTop = frame->slots;
-                push(result);
-
-                // RESTORE_IP();
-                frame = &vm.frames[vm.frameCount - 1];
-                instruction_pointer = frame->ip;
-                break;
+            if (vm->frameCount == 0)
+            {
+                pop();
+                RESTORE_IP();
+                return INTERPRET_OK;
             }
-            default:
-                printf("Unknown op code: [%u]\n", instruction);
-                break;
-               
+
+            registers[0] = result;
+
+            frame = &vm->frames[vm->frameCount - 1];
+            instruction_pointer = frame->registerIp;
+            registers = frame->slots;
+            DISPATCH();
         }
+#ifndef COMPUTED_GOTO
+        default:
+            printf("Unknown op code: [%u]\n", REGISTER_OP(instruction));
+            DISPATCH();
+#endif
     }
-    RESTORE_IP();
-#undef READ_BYTE
-#undef READ_CONSTANT
-#undef READ_STRING
-#undef READ_SHORT
+
+#undef RESTORE_IP
+#undef CONSTANTS
+#undef RA
+#undef RB
+#undef RC
+#undef KC
+#undef READ_TARGET
+#undef GLOBAL_NAME
+#undef NUMBER_OPERANDS
 #undef BINARY_OP
+#undef ADD_OP
+#undef JUMP_UNLESS
+#undef TRACE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
 }
 
-InterpretResult interpret(const char* source)
+// Runs a module's script, which leaves the stack empty again.
+static InterpretResult runFunction(ObjFunction* function)
+{
+    push(OBJ_VAL(function));
+    callValue(OBJ_VAL(function), 0);
+    if (vm->backend == BACKEND_REGISTER)
+    {
+        return enterRegisterFrame(0) ? runRegisters() : INTERPRET_RUNTIME_ERROR;
+    }
+    return run();
+}
+
+static InterpretResult interpretModules(const char* path, Source* source, bool useCache)
 {
     // Compiling
     clock_t begin = clock();
-    ObjFunction* function = compile(source);
+    int* order;
+    bool cached;
+    int count = loadModules(path, source, useCache, &order, &cached);
+    if (count < 0) return INTERPRET_COMPILE_ERROR;
 
-    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    for (int i = 0; i < count && vm->backend == BACKEND_REGISTER; ++i)
+    {
+        if (!translateFunction(vm->modules[order[i]]->function))
+        {
+            free(order);
+            return INTERPRET_COMPILE_ERROR;
+        }
+    }
 
     clock_t end = clock();
-    printf("Compile time: %f seconds\n", (double)(end - begin) / CLOCKS_PER_SEC);
-
-    // Setting function and call frame
-    push(OBJ_VAL(function));
-    callValue(OBJ_VAL(function), 0);
+    fprintf(vm->output, "Compile time: %f seconds%s\n", (double)(end - begin) / CLOCKS_PER_SEC,
+        cached ? " (cached)" : "");
 
-    // Interpreting
+    // Interpreting, each module once and after the modules it imports.
+#ifdef COUNT_INSTRUCTIONS
+    uint64_t instructions = vm->instructionCount;
+#endif
     begin = clock();
-    InterpretResult result = run();
+    InterpretResult result = INTERPRET_OK;
+    for (int i = 0; i < count && result == INTERPRET_OK; ++i)
+    {
+        Module* module = vm->modules[order[i]];
+        bindImports(order[i]);
+        ObjFunction* function = module->function;
+        module->function = NULL;
+        result = runFunction(function);
+
+        // A module that imports this one through a cycle ran first.
+        for (int j = 0; j < i; ++j)
+        {
+            if (importsModule(vm->modules[order[j]], order[i])) bindImports(order[j]);
+        }
+    }
     end = clock();
-    printf("Run time: %f seconds\n", (double)(end - begin) / CLOCKS_PER_SEC);
+    free(order);
+
+    fprintf(vm->output, "Run time: %f seconds\n", (double)(end - begin) / CLOCKS_PER_SEC);
+#ifdef COUNT_INSTRUCTIONS
+    fprintf(vm->output, "Instructions: %llu executed (%s backend)\n",
+        (unsigned long long)(vm->instructionCount - instructions), vm->backend == BACKEND_REGISTER ? "register" : "stack");
+#endif
+    fprintf(vm->output, "GC: %d collections, %f seconds paused (max %f seconds)\n",
+        vm->gcCount, vm->gcPauseTotal, vm->gcPauseMax);
+    return result;
+}
+
+InterpretResult interpret(VM* instance, const char* source)
+{
+    VM* enclosing = vm;
+    vm = instance;
+    Source line = { (char*)source, strlen(source), 0, false };
+    InterpretResult result = interpretModules(NULL, &line, false);
+    vm = enclosing;
+    return result;
+}
+
+InterpretResult interpretFile(VM* instance, const char* path, Source* source, bool useCache)
+{
+    VM* enclosing = vm;
+    vm = instance;
+    InterpretResult result = interpretModules(path, source, useCache);
+    vm = enclosing;
     return result;
 }
@@ -4,6 +4,7 @@
 
 #include "chunk.h"
 #include "object.h"
+#include "source.h"
 #include "table.h"
 #include "value.h"
 
@@ -14,8 +15,44 @@ typedef struct {
     ObjFunction* function;
     uint8_t* ip;
     Value* slots;
+    // The global values of the function's module.
+    Value* globals;
+    // The function's constants, so reading one is a single load.
+    Value* constants;
+    // Frames of earlier functions this one replaced through tail calls.
+    uint64_t tailCalls;
+
+    // Register backend only: the current instruction, and the caller's
+    // stackTop to restore when this frame returns.
+    RegisterInstruction* registerIp;
+    Value* callerTop;
 } CallFrame;
 
+// Each script has a namespace of its own. Globals live in a flat array:
+// the compiler resolves each name to a slot once, through slots, and the
+// opcodes index values. The natives take the first slots of every module.
+typedef struct {
+    // The script's real path, or NULL for the REPL.
+    ObjString* path;
+    Table slots;
+    ValueArray values;
+    ValueArray names;
+
+    // Modules that fill in the globals this one uses but does not define,
+    // just before it runs.
+    int* imports;
+    int importCount;
+    int importCapacity;
+
+    // The compiled script until it has run.
+    ObjFunction* function;
+} Module;
+
+typedef enum {
+    BACKEND_STACK,
+    BACKEND_REGISTER,
+} Backend;
+
 typedef struct {
     CallFrame frames[FRAMES_MAX];
     int frameCount;
@@ -24,8 +61,36 @@ typedef struct {
     Value* stackTop;
 
     Table strings;
-    Table globals;
+    // Random per process, so scripts cannot pick keys that collide.
+    uint64_t hashSeed;
+
+    // Module zero holds the main script or the REPL. Loaded modules are
+    // also found by their path, in modulePaths.
+    Module** modules;
+    int moduleCount;
+    int moduleCapacity;
+    Table modulePaths;
+    // The module that globalSlot() resolves names in.
+    int module;
+    int nativeCount;
     Obj* objects;
+
+    Backend backend;
+#ifdef COUNT_INSTRUCTIONS
+    uint64_t instructionCount;
+#endif
+    // Where print statements and run statistics go; stdout by default.
+    FILE* output;
+
+    size_t bytesAllocated;
+    size_t nextGC;
+    int grayCount;
+    int grayCapacity;
+    Obj** grayStack;
+
+    int gcCount;
+    double gcPauseTotal;
+    double gcPauseMax;
 } VM;
 
 typedef enum {
@@ -34,15 +99,26 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
-extern VM vm;
+// VMs share no state, so each thread can run its own. The entry points
+// below make their VM the calling thread's current one, which everything
+// else works in, for as long as they run.
+extern THREAD_LOCAL VM* vm;
 
-void initVM();
-void freeVM();
+VM* newVM();
+void freeVM(VM* instance);
 
 void push(Value value);
 Value pop();
 
+int newModule(ObjString* path);
+void addImport(int module, int imported);
+int globalSlot(ObjString* name);
 
-InterpretResult interpret(const char* chunk);
+// Runs a REPL line in module zero.
+InterpretResult interpret(VM* instance, const char* chunk);
+// Runs the script at path, and the modules it imports, first. With useCache,
+// bytecode cached for a module is reused when it is still valid, and freshly
+// compiled bytecode is cached.
+InterpretResult interpretFile(VM* instance, const char* path, Source* source, bool useCache);
 
 #endif
@@ -0,0 +1,144 @@
+// Interns identifiers picked so that their 32-bit FNV-1a hashes, which
+// strings were hashed with before, share their low 12 bits. Under that
+// hash they all start probing vm->strings at the same few slots, and each
+// lookup walks the whole cluster. Checks that looking them up takes about
+// as long as looking up ordinary identifiers of the same lengths.
+//
+// Usage: hash_collisions [keys]
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define KEYS 4000
+#define LOW_BITS 0xfff
+#define LOOKUP_ROUNDS 1000
+#define TIMINGS 5
+// How many times longer than ordinary ones colliding lookups may take.
+#define SLOWDOWN_MAX 2.0
+
+typedef struct {
+    char** keys;
+    int count;
+} KeySet;
+
+static uint32_t fnv1a(const char* chars, int length)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; ++i)
+    {
+        hash ^= (uint8_t)chars[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static void addKey(KeySet* set, const char* chars)
+{
+    set->keys[set->count++] = strdup(chars);
+}
+
+// Identifiers are "k" followed by letters counting up. The colliding ones
+// all have the same low FNV-1a bits. The ordinary ones spread evenly over
+// the other values of those bits.
+static void findKeys(int count, KeySet* colliding, KeySet* ordinary)
+{
+    colliding->keys = (char**)malloc(sizeof(char*) * count);
+    ordinary->keys = (char**)malloc(sizeof(char*) * count);
+    if (colliding->keys == NULL || ordinary->keys == NULL) exit(1);
+    colliding->count = 0;
+    ordinary->count = 0;
+
+    char key[16];
+    for (uint64_t n = 0; colliding->count < count || ordinary->count < count; ++n)
+    {
+        int length = 0;
+        key[length++] = 'k';
+        for (uint64_t rest = n; rest > 0 || length == 1; rest /= 26) key[length++] = (char)('a' + rest % 26);
+        key[length] = 0;
+
+        uint32_t low = fnv1a(key, length) & LOW_BITS;
+        if (low == 0 && colliding->count < count)
+        {
+            addKey(colliding, key);
+        }
+        else if (low == (uint32_t)ordinary->count % LOW_BITS + 1 && ordinary->count < count)
+        {
+            addKey(ordinary, key);
+        }
+    }
+}
+
+static void internKeys(KeySet* set)
+{
+    // Pushed so no collection takes them out of vm->strings.
+    for (int i = 0; i < set->count; ++i) push(OBJ_VAL(copyString(set->keys[i], (int)strlen(set->keys[i]))));
+}
+
+// The best of several timings of looking every key up LOOKUP_ROUNDS times.
+static double lookupSeconds(KeySet* set)
+{
+    int* lengths = (int*)malloc(sizeof(int) * set->count);
+    if (lengths == NULL) exit(1);
+    for (int i = 0; i < set->count; ++i) lengths[i] = (int)strlen(set->keys[i]);
+
+    double best = -1;
+    for (int timing = 0; timing < TIMINGS; ++timing)
+    {
+        clock_t begin = clock();
+        for (int round = 0; round < LOOKUP_ROUNDS; ++round)
+        {
+            for (int i = 0; i < set->count; ++i) copyString(set->keys[i], lengths[i]);
+        }
+        double seconds = (double)(clock() - begin) / CLOCKS_PER_SEC;
+        if (best < 0 || seconds < best) best = seconds;
+    }
+    free(lengths);
+    return best;
+}
+
+static void freeKeys(KeySet* set)
+{
+    for (int i = 0; i < set->count; ++i) free(set->keys[i]);
+    free(set->keys);
+}
+
+int main(int argc, const char* argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : KEYS;
+    if (count < 1)
+    {
+        fprintf(stderr, "Usage: hash_collisions [keys]\n");
+        return 64;
+    }
+
+    KeySet colliding;
+    KeySet ordinary;
+    findKeys(count, &colliding, &ordinary);
+
+    VM* machine = newVM();
+    vm = machine;
+    internKeys(&colliding);
+    internKeys(&ordinary);
+
+    double collidingSeconds = lookupSeconds(&colliding);
+    double ordinarySeconds = lookupSeconds(&ordinary);
+    printf("%d colliding keys: %d lookups each in %f seconds\n", count, LOOKUP_ROUNDS, collidingSeconds);
+    printf("%d ordinary keys: %d lookups each in %f seconds\n", count, LOOKUP_ROUNDS, ordinarySeconds);
+
+    bool passed = collidingSeconds <= ordinarySeconds * SLOWDOWN_MAX;
+    if (!passed)
+    {
+        fprintf(stderr, "Colliding keys are %.1f times slower to look up.\n", collidingSeconds / ordinarySeconds);
+    }
+
+    freeVM(machine);
+    freeKeys(&colliding);
+    freeKeys(&ordinary);
+    return passed ? 0 : 1;
+}
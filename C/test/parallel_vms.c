@@ -0,0 +1,209 @@
+// Runs many VMs at once, one after another on each of several threads, and
+// checks that every one printed exactly its own output. Each script sets
+// the same global names to values of its own, builds a long string out of
+// ropes and recurses, so any state leaking between VMs shows up in what
+// they print.
+//
+// Usage: parallel_vms [threads [vms per thread]]
+
+#include "common.h"
+#include "vm.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THREADS 16
+#define VMS_PER_THREAD 20
+#define PIECES 200
+
+typedef struct {
+    int thread;
+    int vmCount;
+    int failures;
+} Worker;
+
+static const char* scriptFormat =
+    "var id = %d;\n"
+    "var count = 0;\n"
+    "fun fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); }\n"
+    "var text = \"\";\n"
+    "for (var i = 0; i < %d; i = i + 1) {\n"
+    "  text = text + \"<\" + \"%d\" + \">\";\n"
+    "  count = count + id;\n"
+    "}\n"
+    "print id;\n"
+    "print count;\n"
+    "print fib(%d);\n"
+    "print text;\n";
+
+static int fib(int n)
+{
+    return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+static char* expectedOutput(int id)
+{
+    char piece[32];
+    int pieceLength = snprintf(piece, sizeof(piece), "<%d>", id);
+
+    size_t capacity = 128 + (size_t)pieceLength * PIECES;
+    char* expected = (char*)malloc(capacity);
+    if (expected == NULL) exit(1);
+    int length = snprintf(expected, capacity, "%d\n%d\n%d\n", id, id * PIECES, fib(10 + id % 8));
+    for (int i = 0; i < PIECES; ++i)
+    {
+        memcpy(expected + length, piece, pieceLength);
+        length += pieceLength;
+    }
+    strcpy(expected + length, "\n");
+    return expected;
+}
+
+// Everything the VM printed, without the run statistics.
+static char* readOutput(FILE* file)
+{
+    rewind(file);
+    size_t capacity = 4096;
+    size_t length = 0;
+    char* output = (char*)malloc(capacity);
+    if (output == NULL) exit(1);
+
+    char line[4096];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (strncmp(line, "Compile time:", 13) == 0 || strncmp(line, "Run time:", 9) == 0 ||
+            strncmp(line, "Instructions:", 13) == 0 || strncmp(line, "GC:", 3) == 0) continue;
+
+        size_t lineLength = strlen(line);
+        if (length + lineLength + 1 > capacity)
+        {
+            capacity = (length + lineLength + 1) * 2;
+            output = (char*)realloc(output, capacity);
+            if (output == NULL) exit(1);
+        }
+        memcpy(output + length, line, lineLength);
+        length += lineLength;
+    }
+    output[length] = 0;
+    return output;
+}
+
+static bool runOne(int id, Backend backend)
+{
+    char script[1024];
+    snprintf(script, sizeof(script), scriptFormat, id, PIECES, id, 10 + id % 8);
+
+    FILE* output = tmpfile();
+    if (output == NULL)
+    {
+        fprintf(stderr, "VM %d: could not open its output file.\n", id);
+        return false;
+    }
+
+    VM* machine = newVM();
+    machine->backend = backend;
+    machine->output = output;
+    InterpretResult result = interpret(machine, script);
+    freeVM(machine);
+
+    char* printed = readOutput(output);
+    char* expected = expectedOutput(id);
+    bool passed = result == INTERPRET_OK && strcmp(printed, expected) == 0;
+    if (!passed)
+    {
+        fprintf(stderr, "VM %d (%s backend) printed:\n%s\nexpected:\n%s\n", id,
+                backend == BACKEND_REGISTER ? "register" : "stack", printed, expected);
+    }
+
+    free(printed);
+    free(expected);
+    fclose(output);
+    return passed;
+}
+
+static void* runWorker(void* argument)
+{
+    Worker* worker = (Worker*)argument;
+    for (int i = 0; i < worker->vmCount; ++i)
+    {
+        int id = worker->thread * worker->vmCount + i;
+        Backend backend = id % 2 == 0 ? BACKEND_STACK : BACKEND_REGISTER;
+        if (!runOne(id, backend)) worker->failures++;
+    }
+    return NULL;
+}
+
+// Two VMs used in turn on one thread keep their own globals.
+static int runInterleaved()
+{
+    FILE* firstOutput = tmpfile();
+    FILE* secondOutput = tmpfile();
+    if (firstOutput == NULL || secondOutput == NULL) return 1;
+
+    VM* first = newVM();
+    VM* second = newVM();
+    first->output = firstOutput;
+    second->output = secondOutput;
+
+    interpret(first, "var x = \"first\";");
+    interpret(second, "var x = \"second\";");
+    interpret(first, "print x;");
+    interpret(second, "print x;");
+    freeVM(first);
+    freeVM(second);
+
+    char* firstPrinted = readOutput(firstOutput);
+    char* secondPrinted = readOutput(secondOutput);
+    int failures = strcmp(firstPrinted, "first\n") != 0 || strcmp(secondPrinted, "second\n") != 0;
+    if (failures > 0)
+    {
+        fprintf(stderr, "Interleaved VMs printed \"%s\" and \"%s\".\n", firstPrinted, secondPrinted);
+    }
+
+    free(firstPrinted);
+    free(secondPrinted);
+    fclose(firstOutput);
+    fclose(secondOutput);
+    return failures;
+}
+
+int main(int argc, const char* argv[])
+{
+    int threadCount = argc > 1 ? atoi(argv[1]) : THREADS;
+    int vmCount = argc > 2 ? atoi(argv[2]) : VMS_PER_THREAD;
+    if (threadCount < 1 || vmCount < 1)
+    {
+        fprintf(stderr, "Usage: parallel_vms [threads [vms per thread]]\n");
+        return 64;
+    }
+
+    Worker* workers = (Worker*)calloc(threadCount, sizeof(Worker));
+    pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * threadCount);
+    if (workers == NULL || threads == NULL) exit(1);
+
+    for (int i = 0; i < threadCount; ++i)
+    {
+        workers[i].thread = i;
+        workers[i].vmCount = vmCount;
+        if (pthread_create(&threads[i], NULL, runWorker, &workers[i]) != 0)
+        {
+            fprintf(stderr, "Could not start thread %d.\n", i);
+            exit(71);
+        }
+    }
+
+    int failures = 0;
+    for (int i = 0; i < threadCount; ++i)
+    {
+        pthread_join(threads[i], NULL);
+        failures += workers[i].failures;
+    }
+    failures += runInterleaved();
+
+    printf("%d VMs on %d threads, %d failed\n", threadCount * vmCount + 2, threadCount, failures);
+    free(workers);
+    free(threads);
+    return failures > 0 ? 1 : 0;
+}